@@ -0,0 +1,362 @@
+/**
+ * @file wl_log_bench.c
+ * @brief Cost of the logging hot paths, from filtered-out calls to contended producers.
+ *
+ * Cases, in the order they run:
+ * - filtered_level:    WL_LOGD on a tag whose level is WARN
+ * - filtered_excluded: WL_LOGI on an excluded tag
+ * - rate_limited:      WL_LOGW on a tag limited to 1 message per second (WL_LOG_RATE_LIMIT builds)
+ * - sampled:           WL_LOGD on a tag sampled 1 in 1000000 (WL_LOG_SAMPLING builds)
+ * - null_sink:         accepted WL_LOGI written straight to stdout
+ * - hex_<n>/dump_<n>:  wl_log_buffer_hex/wl_log_dump of n bytes, straight to stdout
+ * - ring:              one producer logging into the circular buffer
+ * - contended:         2 to N producers logging into the circular buffer
+ * - contended_direct:  2 to N producers writing straight to stdout, only the commit is serialized
+ *
+ * The buffered cases log in rounds small enough for the buffer, and main
+ * drains it between rounds outside the timing, so no call is dropped and
+ * ns_per_call is the cost of an accepted call even on a single CPU.
+ * Built with WL_LOG_ASYNC, the library writer thread drains as well.
+ * stdout is replaced by a counting stream, so the output itself costs
+ * nothing and delivered lines can be told apart from dropped ones.
+ * Built with WL_LOG_FILE, every case writes to wl_log_bench.log through the
+ * file sink instead, and delivered lines are counted in the file.
+ *
+ * Usage: wl_log_bench [max_threads] [calls_per_thread]
+ *
+ * Every result is one line of key=value pairs on stderr, e.g.
+ * case=ring ring=mpsc_lockfree lock=none sink=console threads=1 calls=200000 delivered=200000 ns_per_call=310.2 calls_per_s=3223726
+ *
+ * @license MIT License
+ */
+
+#define _GNU_SOURCE
+#include "wl_log.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(WL_LOG_DEFERRED)
+#define BENCH_RING "deferred"
+#elif defined(WL_LOG_BUFFER_PER_THREAD)
+#define BENCH_RING "per_thread"
+#elif defined(WL_LOG_ASYNC)
+#define BENCH_RING "async_writer"
+#elif defined(WL_LOG_BUFFER_LOCKFREE)
+#define BENCH_RING "mpsc_lockfree"
+#else
+#define BENCH_RING "byte_locked"
+#endif
+
+#if !defined(WL_LOG_USE_MUTEX)
+#define BENCH_LOCK "none"
+#elif defined(WL_LOG_LOCK) && WL_LOG_LOCK == WL_LOG_LOCK_TICKET
+#define BENCH_LOCK "ticket"
+#elif defined(WL_LOG_LOCK) && WL_LOG_LOCK == WL_LOG_LOCK_MCS
+#define BENCH_LOCK "mcs"
+#elif defined(WL_LOG_LOCK) && WL_LOG_LOCK == WL_LOG_LOCK_TAS
+#define BENCH_LOCK "tas"
+#else
+#define BENCH_LOCK "pthread"
+#endif
+
+#ifdef WL_LOG_FILE
+#define BENCH_SINK "file"
+#define BENCH_FILE "wl_log_bench.log"
+#else
+#define BENCH_SINK "console"
+#endif
+
+typedef enum
+{
+    BENCH_FILTERED_LEVEL,
+    BENCH_FILTERED_EXCLUDED,
+    BENCH_RATE_LIMITED,
+    BENCH_SAMPLED,
+    BENCH_MESSAGE,
+    BENCH_PRECISION,
+    BENCH_HEX,
+    BENCH_DUMP
+} bench_call_t;
+
+/* Generous size of one buffered line, record header included */
+#define BENCH_RECORD_BYTES 256
+
+static volatile unsigned long delivered_lines;
+static int calls_per_thread = 200000;
+
+static bench_call_t bench_call;
+static size_t bench_size;
+static int bench_calls;
+static int bench_round; /* calls per producer between drains, 0 when unbuffered */
+static uint8_t bench_data[4096];
+/* Not terminated, "%.*s" must stop at the precision */
+static const char bench_name[5] = {'s', 'e', 'n', 's', 'e'};
+
+static pthread_barrier_t start_barrier;
+static pthread_barrier_t round_barrier; /* producers and main, around each drain */
+static uint64_t *producer_ns; /* time each producer spent in its calls */
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* stdout replacement, counts lines and throws the bytes away */
+static ssize_t count_write(void *cookie, const char *data, size_t len)
+{
+    (void)cookie;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (data[i] == '\n')
+        {
+            delivered_lines++;
+        }
+    }
+    return (ssize_t)len;
+}
+
+static void bench_one(int id, int i)
+{
+    switch (bench_call)
+    {
+    case BENCH_FILTERED_LEVEL:
+        WL_LOGD("bench_level", "producer %d message %d value %u", id, i, (unsigned)i * 2654435761u);
+        break;
+    case BENCH_FILTERED_EXCLUDED:
+        WL_LOGI("bench_excluded", "producer %d message %d value %u", id, i, (unsigned)i * 2654435761u);
+        break;
+    case BENCH_RATE_LIMITED:
+        WL_LOGW("bench_limited", "producer %d message %d value %u", id, i, (unsigned)i * 2654435761u);
+        break;
+    case BENCH_SAMPLED:
+        WL_LOGD("bench_sampled", "producer %d message %d value %u", id, i, (unsigned)i * 2654435761u);
+        break;
+    case BENCH_MESSAGE:
+        WL_LOGI("bench", "producer %d message %d value %u", id, i, (unsigned)i * 2654435761u);
+        break;
+    case BENCH_PRECISION:
+        WL_LOGI("bench", "producer %d message %d name %.*s", id, i, (int)sizeof(bench_name), bench_name);
+        break;
+    case BENCH_HEX:
+        wl_log_buffer_hex(WL_LOG_INFO, "bench", bench_data, bench_size);
+        break;
+    case BENCH_DUMP:
+        wl_log_dump(WL_LOG_INFO, "bench", bench_data, bench_size);
+        break;
+    }
+}
+
+static void *producer(void *arg)
+{
+    int id = (int)(intptr_t)arg;
+    int round = bench_round > 0 ? bench_round : bench_calls;
+    uint64_t spent = 0;
+    pthread_barrier_wait(&start_barrier);
+    for (int done = 0; done < bench_calls; done += round)
+    {
+        int end = bench_calls - done > round ? done + round : bench_calls;
+        /* Timed here, main may only get the CPU back once producers are done */
+        uint64_t start = now_ns();
+        for (int i = done; i < end; i++)
+        {
+            bench_one(id, i);
+        }
+        spent += now_ns() - start;
+        if (bench_round > 0)
+        {
+            /* Main drains between the two */
+            pthread_barrier_wait(&round_barrier);
+            pthread_barrier_wait(&round_barrier);
+        }
+    }
+    producer_ns[id] = spent;
+    return NULL;
+}
+
+#ifdef WL_LOG_FILE
+/* Lines the file sink wrote since the last call, the file starts over each time */
+static unsigned long file_lines(void)
+{
+    wl_log_flush();
+    unsigned long lines = 0;
+    FILE *file = fopen(BENCH_FILE, "rb");
+    if (file != NULL)
+    {
+        char chunk[1 << 16];
+        size_t got;
+        while ((got = fread(chunk, 1, sizeof(chunk), file)) > 0)
+        {
+            for (size_t i = 0; i < got; i++)
+            {
+                lines += chunk[i] == '\n';
+            }
+        }
+        fclose(file);
+    }
+    /* The sink appends, truncating under it is safe */
+    truncate(BENCH_FILE, 0);
+    return lines;
+}
+#endif
+
+/* Time calls from every thread, draining between rounds when buffered */
+static void run(const char *name, bench_call_t call, size_t size, int threads, int calls, int buffered)
+{
+    pthread_t producers[threads];
+    uint64_t producer_times[threads];
+
+    bench_call = call;
+    bench_size = size;
+    bench_calls = calls;
+    bench_round = 0;
+    delivered_lines = 0;
+    producer_ns = producer_times;
+    wl_log_set_buffered(buffered);
+    pthread_barrier_init(&start_barrier, NULL, (unsigned)threads + 1);
+    pthread_barrier_init(&round_barrier, NULL, (unsigned)threads + 1);
+    if (buffered)
+    {
+        /* Every producer's round fits in the buffer at once */
+        bench_round = WL_LOG_BUFFER_SIZE / (BENCH_RECORD_BYTES * threads);
+        bench_round = bench_round > 0 ? bench_round : 1;
+#ifdef WL_LOG_ASYNC
+        wl_log_async_start(NULL);
+#endif
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_create(&producers[i], NULL, producer, (void *)(intptr_t)i);
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    if (bench_round > 0)
+    {
+        for (int done = 0; done < calls; done += bench_round)
+        {
+            pthread_barrier_wait(&round_barrier);
+            wl_log_process_buffer();
+            pthread_barrier_wait(&round_barrier);
+        }
+    }
+    uint64_t elapsed = 0;
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_join(producers[i], NULL);
+        /* The slowest producer sets the time */
+        if (producer_times[i] > elapsed)
+        {
+            elapsed = producer_times[i];
+        }
+    }
+
+#ifdef WL_LOG_ASYNC
+    if (buffered)
+    {
+        wl_log_async_stop();
+    }
+#endif
+    wl_log_process_buffer();
+    fflush(stdout);
+    pthread_barrier_destroy(&start_barrier);
+    pthread_barrier_destroy(&round_barrier);
+#ifdef WL_LOG_FILE
+    delivered_lines = file_lines();
+#endif
+
+    unsigned long total = (unsigned long)threads * (unsigned long)calls;
+    if (elapsed == 0)
+    {
+        elapsed = 1;
+    }
+    fprintf(stderr, "case=%s ring=%s lock=%s sink=%s threads=%d calls=%lu delivered=%lu ns_per_call=%.1f calls_per_s=%.0f\n",
+            name, BENCH_RING, BENCH_LOCK, BENCH_SINK, threads, total, delivered_lines,
+            (double)elapsed / (double)total, (double)total * 1e9 / (double)elapsed);
+}
+
+int main(int argc, char **argv)
+{
+    int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+    if (argc > 2)
+    {
+        calls_per_thread = atoi(argv[2]);
+    }
+
+    cookie_io_functions_t counter = {.write = count_write};
+    stdout = fopencookie(NULL, "w", counter);
+    setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+
+    for (size_t i = 0; i < sizeof(bench_data); i++)
+    {
+        bench_data[i] = (uint8_t)(i * 131u);
+    }
+
+    wl_log_init();
+#ifdef WL_LOG_FILE
+    /* No rotation, every run is counted in one file */
+    wl_log_file_config_t file_config = WL_LOG_FILE_CONFIG_DEFAULT;
+    file_config.max_bytes = 0;
+    file_config.fsync = WL_LOG_FILE_FSYNC_NEVER;
+    if (wl_log_file_open(BENCH_FILE, &file_config) != 0)
+    {
+        fprintf(stderr, "cannot open %s\n", BENCH_FILE);
+        return 1;
+    }
+    wl_log_remove_sink(&wl_log_console_sink);
+    file_lines();
+#endif
+    /* Deferred records carry a tag handle, only known tags are deferred */
+    wl_log_register_tag("bench");
+    wl_log_set_level("bench_level", WL_LOG_WARN);
+    wl_log_exclude_tag("bench_excluded");
+#ifdef WL_LOG_RATE_LIMIT
+    wl_log_set_rate_limit("bench_limited", WL_LOG_WARN, 1, 1);
+#endif
+#ifdef WL_LOG_SAMPLING
+    wl_log_set_sampling("bench_sampled", WL_LOG_DEBUG, 1000000);
+#endif
+
+    run("filtered_level", BENCH_FILTERED_LEVEL, 0, 1, calls_per_thread, 0);
+    run("filtered_excluded", BENCH_FILTERED_EXCLUDED, 0, 1, calls_per_thread, 0);
+#ifdef WL_LOG_RATE_LIMIT
+    run("rate_limited", BENCH_RATE_LIMITED, 0, 1, calls_per_thread, 0);
+#endif
+#ifdef WL_LOG_SAMPLING
+    run("sampled", BENCH_SAMPLED, 0, 1, calls_per_thread, 0);
+#endif
+    run("null_sink", BENCH_MESSAGE, 0, 1, calls_per_thread, 0);
+
+    static const size_t sizes[] = {16, 256, 4096};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        /* Roughly the same amount of output per size */
+        int calls = (int)(calls_per_thread / (1 + sizes[i] / 16));
+        calls = calls > 0 ? calls : 1;
+        char name[32];
+        snprintf(name, sizeof(name), "hex_%zu", sizes[i]);
+        run(name, BENCH_HEX, sizes[i], 1, calls, 0);
+        snprintf(name, sizeof(name), "dump_%zu", sizes[i]);
+        run(name, BENCH_DUMP, sizes[i], 1, calls, 0);
+    }
+
+    run("ring", BENCH_MESSAGE, 0, 1, calls_per_thread, 1);
+    run("precision_string", BENCH_PRECISION, 0, 1, calls_per_thread, 1);
+    for (int threads = 2; threads <= max_threads; threads *= 2)
+    {
+        run("contended", BENCH_MESSAGE, 0, threads, calls_per_thread, 1);
+    }
+    for (int threads = 2; threads <= max_threads; threads *= 2)
+    {
+        run("contended_direct", BENCH_MESSAGE, 0, threads, calls_per_thread, 0);
+    }
+#ifdef WL_LOG_FILE
+    wl_log_file_close();
+    unlink(BENCH_FILE);
+#endif
+    return 0;
+}
@@ -0,0 +1,58 @@
+// Build on Linux with the persistent ring, e.g.
+//   gcc -DWL_LOG_PERSIST -DWL_LOG_PERSIST_PATH='"/tmp/wl_log.ring"' -Iinclude examples/persist_crash.c src/wl_log.c
+// A child logs as fast as it can and is killed with SIGKILL, the next wl_log_init recovers its last lines.
+#define _GNU_SOURCE
+#include "wl_log.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static long last_recovered = -1;
+
+// Keep the tick number of every recovered line, and still print it
+static void check_write(void* ctx, const wl_log_iovec_t* iov, size_t count) {
+    (void)ctx;
+    for (size_t i = 0; i < count; i++) {
+        fwrite(iov[i].data, 1, iov[i].len, stdout);
+        const char* tick = memmem(iov[i].data, iov[i].len, "tick ", 5);
+        if (tick != NULL) {
+            last_recovered = strtol(tick + 5, NULL, 10);
+        }
+    }
+}
+
+static const wl_log_sink_t check_sink = {check_write, NULL, NULL};
+
+int main() {
+    // The child publishes the last tick it finished logging here
+    volatile long* progress = mmap(NULL, sizeof(long), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    *progress = -1;
+
+    pid_t child = fork();
+    if (child == 0) {
+        wl_log_init();
+        wl_log_remove_sink(&wl_log_console_sink);
+        for (long i = 0;; i++) {
+            WL_LOGI("worker", "tick %ld", i);
+            *progress = i;
+        }
+    }
+
+    usleep(200000);
+    kill(child, SIGKILL);
+    waitpid(child, NULL, 0);
+
+    // Recovery happens here, before anything new is logged
+    wl_log_remove_sink(&wl_log_console_sink);
+    wl_log_add_sink(&check_sink);
+    wl_log_init();
+
+    // The kill can land between the log call and the progress update
+    int ok = last_recovered == *progress || last_recovered == *progress + 1;
+    WL_LOGI("main", "child reached tick %ld, last recovered tick %ld: %s", *progress, last_recovered, ok ? "OK" : "FAILED");
+    return ok ? 0 : 1;
+}
@@ -37,6 +37,22 @@ extern "C" {
 #define WL_LOG_BUFFER_SIZE 1024  /**< Default ring buffer size */
 #endif
 
+/* Maximum number of tags with their own level or exclusion */
+#ifndef WL_LOG_MAX_TAGS
+#define WL_LOG_MAX_TAGS 32
+#endif
+
+/* Maximum number of output sinks registered at the same time */
+#ifndef WL_LOG_MAX_SINKS
+#define WL_LOG_MAX_SINKS 4
+#endif
+
+/* Lock behind WL_LOG_USE_MUTEX on platforms without an RTOS mutex, set WL_LOG_LOCK to one of these */
+#define WL_LOG_LOCK_PTHREAD 1  /**< pthread mutex, futex based on Linux. Default on POSIX hosts */
+#define WL_LOG_LOCK_TICKET 2   /**< FIFO ticket spinlock, waiters behind the next one yield */
+#define WL_LOG_LOCK_MCS 3      /**< MCS queue lock, every waiter spins on its own node */
+#define WL_LOG_LOCK_TAS 4      /**< Test-and-test-and-set with exponential backoff. Default elsewhere */
+
 /* Define whether to use UART instead of stdout */
 #ifdef WL_LOG_USE_UART
 void wl_log_uart_init(void);                  /**< Initialize UART for logging */
@@ -50,6 +66,25 @@ void wl_log_uart_write(const char* data);     /**< Send data through UART */
 #define WL_LOG_USE_COLORS 0
 #endif
 
+/* Timestamps print as "(millis)", or "(millis.micros)" with WL_LOG_TIMESTAMP_US defined */
+
+/* Compile-time level floor. Calls above it are type-checked but never emitted */
+#ifndef WL_LOG_MIN_LEVEL
+#define WL_LOG_MIN_LEVEL WL_LOG_VERBOSE
+#endif
+
+/* Per translation unit floor, define it before including wl_log.h */
+#ifndef WL_LOG_LOCAL_LEVEL
+#define WL_LOG_LOCAL_LEVEL WL_LOG_MIN_LEVEL
+#endif
+
+/* Let the compiler check format strings against their arguments */
+#if defined(__GNUC__) || defined(__clang__)
+#define WL_LOG_PRINTF_FORMAT(fmt, args) __attribute__((format(printf, fmt, args)))
+#else
+#define WL_LOG_PRINTF_FORMAT(fmt, args)
+#endif
+
 typedef enum {
     WL_LOG_NONE,     /**< No logging */
     WL_LOG_ERROR,    /**< Error logging level */
@@ -59,11 +94,41 @@ typedef enum {
     WL_LOG_VERBOSE   /**< Verbose logging level */
 } wl_log_level_t;
 
-/* Initialize the logging system */
+/* Interned tag handle, see wl_log_register_tag */
+typedef int16_t wl_log_tag_t;
+
+#define WL_LOG_TAG_INVALID ((wl_log_tag_t)-1)  /**< Returned when the tag table is full */
+
+/* One span of a vectored write, like struct iovec */
+typedef struct {
+    const char* data;  /**< Bytes to write, not NUL terminated */
+    size_t len;        /**< Number of bytes */
+} wl_log_iovec_t;
+
+/* Output transport. write gets every span of one message in order, flush may be NULL */
+typedef struct {
+    void (*write)(void* ctx, const wl_log_iovec_t* iov, size_t count);
+    void (*flush)(void* ctx);
+    void* ctx;         /**< Passed back to both callbacks */
+} wl_log_sink_t;
+
+/* Timestamp source, monotonic microseconds since an arbitrary origin */
+typedef uint64_t (*wl_log_clock_t)(void);
+
+/* stdout, or wl_log_uart_write with WL_LOG_USE_UART. Registered by default */
+extern const wl_log_sink_t wl_log_console_sink;
+
+/* Initialize the logging system. With WL_LOG_PERSIST it first replays what the previous run left in the persistent ring */
 void wl_log_init(void); 
 
 /* Internal func, avoid using it. Use the macros */
-void wl_log_print(wl_log_level_t level, const char* tag, const char* format, ...);
+void wl_log_print(wl_log_level_t level, const char* tag, const char* format, ...) WL_LOG_PRINTF_FORMAT(3, 4);
+
+/* Register a tag once and log through its handle, level and exclusion resolve with one array index */
+wl_log_tag_t wl_log_register_tag(const char* tag);
+
+/* Internal func, avoid using it. Use the WL_LOGx_H macros */
+void wl_log_print_tag(wl_log_level_t level, wl_log_tag_t tag, const char* format, ...) WL_LOG_PRINTF_FORMAT(3, 4);
 
 /* Log a buffer of bytes in hexadecimal format */
 void wl_log_buffer_hex(wl_log_level_t level, const char* tag, const uint8_t* buffer, size_t len);
@@ -80,18 +145,200 @@ void wl_log_include_tag(const char* tag);
 /* Set the log level for a specific tag */
 void wl_log_set_level(const char* tag, wl_log_level_t level);
 
+/* Route messages to the circular buffer (1) or straight to stdout/UART (0) */
+void wl_log_set_buffered(int enable);
+
 /* Process and output any logs stored in the circular buffer */
 void wl_log_process_buffer(void);  
 
-#define WL_LOGE(tag, format, ...) wl_log_print(WL_LOG_ERROR, tag, format, ##__VA_ARGS__)
+/* Drain at most budget bytes, e.g. from an idle hook. Returns the bytes drained, 0 once the buffer is empty */
+size_t wl_log_process_buffer_budget(size_t budget);
+
+/* Drain the circular buffer and flush the output */
+void wl_log_flush(void);
+
+/* Platform monotonic clock in microseconds, the default timestamp source */
+uint64_t wl_log_clock_monotonic(void);
+
+/* Cheapest clock the platform has, ticks in steps of a few ms (CLOCK_MONOTONIC_COARSE on Linux) */
+uint64_t wl_log_clock_coarse(void);
+
+/* Take timestamps from another source, e.g. a hardware timer. NULL restores wl_log_clock_monotonic */
+void wl_log_set_clock(wl_log_clock_t clock);
+
+/* Send every message to one more sink, which must outlive its registration. Returns 0, or -1 when the table is full */
+int wl_log_add_sink(const wl_log_sink_t* sink);
+
+/* Stop sending messages to a sink, e.g. &wl_log_console_sink. Returns 0, or -1 when it was not registered */
+int wl_log_remove_sink(const wl_log_sink_t* sink);
+
+#ifdef WL_LOG_RATE_LIMIT
+/* Token bucket for a tag: per_second messages on average, bursts of up to burst. Applies to level and
+ * the less severe levels, e.g. WL_LOG_WARN spares errors. per_second 0 removes the limit */
+void wl_log_set_rate_limit(const char* tag, wl_log_level_t level, uint32_t per_second, uint32_t burst);
+#endif
+
+#ifdef WL_LOG_SAMPLING
+/* Keep one message in n of a tag at one level, e.g. WL_LOG_DEBUG. n of 0 or 1 keeps them all */
+void wl_log_set_sampling(const char* tag, wl_log_level_t level, uint32_t n);
+
+/* Messages of a tag dropped by sampling so far */
+uint32_t wl_log_get_sampled_out(const char* tag);
+#endif
+
+#ifdef WL_LOG_STATS
+/* Counters of the logger itself. Per level arrays are indexed by wl_log_level_t */
+typedef struct {
+    uint32_t emitted[WL_LOG_VERBOSE + 1];        /**< Written out, or stored whole in the buffer */
+    uint32_t filtered[WL_LOG_VERBOSE + 1];       /**< Rejected by level, exclusion, sampling, rate limit or as a repeat */
+    uint32_t dropped[WL_LOG_VERBOSE + 1];        /**< Lost in full or in part to a full buffer */
+    uint32_t dropped_bytes[WL_LOG_VERBOSE + 1];  /**< Bytes those messages lost */
+    uint32_t truncated[WL_LOG_VERBOSE + 1];      /**< Cut to fit the line or the deferred record */
+    uint32_t ring_high_water;                    /**< Most bytes ever in use in the buffer (in one ring) */
+    uint32_t lock_waits;                         /**< Times the log mutex was taken */
+    uint64_t lock_wait_ns;                       /**< Total time spent waiting for it */
+    uint64_t lock_wait_max_ns;                   /**< Longest single wait */
+} wl_log_stats_t;
+
+/* Copy the counters, cheap enough to poll */
+void wl_log_get_stats(wl_log_stats_t* stats);
+
+/* Set every counter back to zero */
+void wl_log_reset_stats(void);
+#endif
+
+#ifdef WL_LOG_LATENCY
+/* Duration of wl_log_print, wl_log_buffer_hex and wl_log_dump calls at one level */
+typedef struct {
+    uint32_t count;    /**< Calls recorded since the last reset */
+    uint64_t p50_ns;   /**< Median */
+    uint64_t p99_ns;
+    uint64_t p999_ns;  /**< 99.9th percentile */
+    uint64_t max_ns;   /**< Slowest call, exact */
+} wl_log_latency_t;
+
+/* Percentiles of one level, from a log-linear histogram (within 1/16 of the value) */
+void wl_log_get_latency(wl_log_level_t level, wl_log_latency_t* latency);
+
+/* Log one line per level that has calls, through the usual sinks */
+void wl_log_print_latency(void);
+
+/* Empty every histogram */
+void wl_log_reset_latency(void);
+#endif
+
+#ifdef WL_LOG_FLIGHT_RECORDER
+/* Messages at level and below (DEBUG takes VERBOSE too) are only kept in RAM, WL_LOG_NONE sends everything out.
+ * An error replays the last records, or the last age_ms of them, ahead of itself. 0 means no limit */
+void wl_log_set_flight_recorder(wl_log_level_t level, uint32_t records, uint32_t age_ms);
+
+/* Replay the recorded history now, as an error does */
+void wl_log_flight_trigger(void);
+#endif
+
+#ifdef WL_LOG_FILE
+/* When the file sink asks the kernel to put the file on disk */
+typedef enum {
+    WL_LOG_FILE_FSYNC_NEVER,      /**< Leave it to the kernel */
+    WL_LOG_FILE_FSYNC_ERROR,      /**< Soon after every ERROR line */
+    WL_LOG_FILE_FSYNC_PERIODIC    /**< Every fsync_ms */
+} wl_log_file_fsync_t;
+
+typedef struct {
+    uint32_t buffer_size;         /**< User space buffer, written with one write(2) when full or flushed */
+    uint32_t flush_ms;            /**< Also write it out this often, 0 only when full or on wl_log_flush */
+    uint64_t max_bytes;           /**< Rotate once the file holds this much, 0 for no size limit */
+    uint32_t max_age_ms;          /**< Rotate this long after the file was opened, 0 for no time limit */
+    uint32_t max_files;           /**< Rotated files kept, path.1 (newest) to path.max_files */
+    wl_log_file_fsync_t fsync;    /**< fsync policy */
+    uint32_t fsync_ms;            /**< Interval for WL_LOG_FILE_FSYNC_PERIODIC */
+} wl_log_file_config_t;
+
+#define WL_LOG_FILE_CONFIG_DEFAULT { 1u << 20, 1000, 64ull << 20, 0, 5, WL_LOG_FILE_FSYNC_ERROR, 1000 }
+
+/* Append every message to path as a sink, NULL uses WL_LOG_FILE_CONFIG_DEFAULT. Returns 0 on success */
+int wl_log_file_open(const char* path, const wl_log_file_config_t* config);
+
+/* Write out what is buffered, unregister the sink and close the file */
+void wl_log_file_close(void);
+#endif
+
+#ifdef WL_LOG_DEFERRED
+/* Drain deferred records as a binary stream (1) for wl_log_decode instead of text (0) */
+void wl_log_set_binary_output(int enable);
+#endif
+
+#ifdef WL_LOG_ASYNC
+/* When producers wake the writer thread, WL_LOG_ERROR always wakes it */
+typedef enum {
+    WL_LOG_ASYNC_WAKE_PERIODIC,   /**< Never, the writer polls every period_ms */
+    WL_LOG_ASYNC_WAKE_THRESHOLD,  /**< Once wake_bytes are pending */
+    WL_LOG_ASYNC_WAKE_EACH        /**< On every message */
+} wl_log_async_wake_t;
+
+/* When the writer thread flushes stdout */
+typedef enum {
+    WL_LOG_ASYNC_FLUSH_EACH,      /**< After every drain that wrote something */
+    WL_LOG_ASYNC_FLUSH_PERIODIC,  /**< At most every flush_ms */
+    WL_LOG_ASYNC_FLUSH_NEVER      /**< Leave it to stdio buffering and wl_log_flush */
+} wl_log_async_flush_t;
+
+typedef struct {
+    wl_log_async_wake_t wake;     /**< Wake-up policy */
+    uint32_t period_ms;           /**< Longest sleep of the writer */
+    uint32_t wake_bytes;          /**< Pending bytes for WL_LOG_ASYNC_WAKE_THRESHOLD */
+    wl_log_async_flush_t flush;   /**< Flush policy */
+    uint32_t flush_ms;            /**< Interval for WL_LOG_ASYNC_FLUSH_PERIODIC */
+} wl_log_async_config_t;
+
+#define WL_LOG_ASYNC_CONFIG_DEFAULT { WL_LOG_ASYNC_WAKE_THRESHOLD, 10, WL_LOG_BUFFER_SIZE / 4, WL_LOG_ASYNC_FLUSH_EACH, 0 }
+
+/* Start the background writer, NULL uses WL_LOG_ASYNC_CONFIG_DEFAULT. Returns 0 on success */
+int wl_log_async_start(const wl_log_async_config_t* config);
+
+/* Write everything still queued and stop the background writer */
+void wl_log_async_stop(void);
+#endif
+
+/* Levels above WL_LOG_LOCAL_LEVEL fold to a dead branch, arguments are never evaluated */
+#define WL_LOG_LEVEL(level, tag, format, ...)                    \
+    do                                                           \
+    {                                                            \
+        if ((level) <= WL_LOG_LOCAL_LEVEL)                       \
+        {                                                        \
+            wl_log_print(level, tag, format, ##__VA_ARGS__);     \
+        }                                                        \
+    } while (0)
+
+#define WL_LOG_LEVEL_H(level, tag_handle, format, ...)                  \
+    do                                                                  \
+    {                                                                   \
+        if ((level) <= WL_LOG_LOCAL_LEVEL)                              \
+        {                                                               \
+            wl_log_print_tag(level, tag_handle, format, ##__VA_ARGS__); \
+        }                                                               \
+    } while (0)
+
+#define WL_LOGE(tag, format, ...) WL_LOG_LEVEL(WL_LOG_ERROR, tag, format, ##__VA_ARGS__)
+
+#define WL_LOGW(tag, format, ...) WL_LOG_LEVEL(WL_LOG_WARN, tag, format, ##__VA_ARGS__)
+
+#define WL_LOGI(tag, format, ...) WL_LOG_LEVEL(WL_LOG_INFO, tag, format, ##__VA_ARGS__)
+
+#define WL_LOGD(tag, format, ...) WL_LOG_LEVEL(WL_LOG_DEBUG, tag, format, ##__VA_ARGS__)
+
+#define WL_LOGV(tag, format, ...) WL_LOG_LEVEL(WL_LOG_VERBOSE, tag, format, ##__VA_ARGS__)
+
+/* Same levels with a handle from wl_log_register_tag */
+#define WL_LOGE_H(tag_handle, format, ...) WL_LOG_LEVEL_H(WL_LOG_ERROR, tag_handle, format, ##__VA_ARGS__)
 
-#define WL_LOGW(tag, format, ...) wl_log_print(WL_LOG_WARN, tag, format, ##__VA_ARGS__)
+#define WL_LOGW_H(tag_handle, format, ...) WL_LOG_LEVEL_H(WL_LOG_WARN, tag_handle, format, ##__VA_ARGS__)
 
-#define WL_LOGI(tag, format, ...) wl_log_print(WL_LOG_INFO, tag, format, ##__VA_ARGS__)
+#define WL_LOGI_H(tag_handle, format, ...) WL_LOG_LEVEL_H(WL_LOG_INFO, tag_handle, format, ##__VA_ARGS__)
 
-#define WL_LOGD(tag, format, ...) wl_log_print(WL_LOG_DEBUG, tag, format, ##__VA_ARGS__)
+#define WL_LOGD_H(tag_handle, format, ...) WL_LOG_LEVEL_H(WL_LOG_DEBUG, tag_handle, format, ##__VA_ARGS__)
 
-#define WL_LOGV(tag, format, ...) wl_log_print(WL_LOG_VERBOSE, tag, format, ##__VA_ARGS__)
+#define WL_LOGV_H(tag_handle, format, ...) WL_LOG_LEVEL_H(WL_LOG_VERBOSE, tag_handle, format, ##__VA_ARGS__)
 
 #ifdef __cplusplus
 }
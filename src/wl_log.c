@@ -33,6 +33,10 @@
  *
  */
 
+/* clock_gettime, CLOCK_MONOTONIC and the rest of POSIX.1-2008, also under a strict -std=c11 */
+#if !defined(_POSIX_C_SOURCE) && !defined(_GNU_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
 
 #include "wl_log.h"
 #include <stdarg.h>
@@ -89,9 +93,36 @@
 #define ANSI_COLOR_RESET ""
 #endif
 
-#define MAX_EXCLUDED_TAGS 10
 #define MAX_TAG_LENGTH 20
-#define MAX_LOG_LEVEL_TAGS 10
+
+/* One formatted line: header and body built in a single buffer, the trailer is a separate span */
+#define LOG_BODY_SIZE 256
+#define LOG_TAG_PRINT_MAX 48
+#define LOG_TIME_SIZE (1 + 20 + 4 + 1)
+#define LOG_HEADER_SIZE (5 + LOG_TIME_SIZE + 9 + 2 + LOG_TAG_PRINT_MAX + 3)
+#define LOG_LINE_SIZE (LOG_HEADER_SIZE + LOG_BODY_SIZE)
+
+static const char log_trailer[] = ANSI_COLOR_RESET "\n";
+#define LOG_TRAILER_LEN (sizeof(log_trailer) - 1)
+
+/* One wl_log_dump row: newline, offset, ": " and 16 "XX " */
+#define HEX_ROW_SIZE (1 + 2 * sizeof(unsigned int) + 2 + 16 * 3)
+
+static const char hex_digits[16] = "0123456789ABCDEF";
+
+/* Open addressing index over the tag table, must be a power of two */
+#ifndef WL_LOG_TAG_HASH_SIZE
+#define WL_LOG_TAG_HASH_SIZE 64
+#endif
+
+#if (WL_LOG_TAG_HASH_SIZE & (WL_LOG_TAG_HASH_SIZE - 1)) != 0 || WL_LOG_TAG_HASH_SIZE < 2 * WL_LOG_MAX_TAGS
+#error "WL_LOG_TAG_HASH_SIZE must be a power of two of at least 2 * WL_LOG_MAX_TAGS"
+#endif
+
+/* The file sink's helper thread shares the buffer with callers, it needs the log mutex */
+#if defined(WL_LOG_FILE) && !defined(WL_LOG_USE_MUTEX)
+#define WL_LOG_USE_MUTEX
+#endif
 
 //if mutex is defined, need include as following
 #ifdef WL_LOG_USE_MUTEX
@@ -132,414 +163,3578 @@ static osMutexId log_mutex;
 #define LOG_MUTEX_UNLOCK() osMutexRelease(log_mutex)
 
 #else
-/* Other platforms, spinlock */
-#include <stdint.h>
-
-volatile uint32_t log_lock = 0;
-#define LOG_MUTEX_LOCK()                           \
-    while (__sync_lock_test_and_set(&log_lock, 1)) \
-    {                                              \
-    }
-#define LOG_MUTEX_UNLOCK() __sync_lock_release(&log_lock)
+/* Other platforms, statically initialized lock picked by WL_LOG_LOCK */
+#define LOG_LOCK_STATIC
 
+#if defined(__unix__) || defined(__APPLE__)
+#define LOG_LOCK_HOSTED
+#include <sched.h>
 #endif
+
+#ifndef WL_LOG_LOCK
+#ifdef LOG_LOCK_HOSTED
+#define WL_LOG_LOCK WL_LOG_LOCK_PTHREAD
 #else
-/*if not defined, void funcs*/
-#define LOG_MUTEX_LOCK()
-#define LOG_MUTEX_UNLOCK()
+#define WL_LOG_LOCK WL_LOG_LOCK_TAS
+#endif
 #endif
 
+#if WL_LOG_LOCK == WL_LOG_LOCK_PTHREAD
+#include <pthread.h>
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define LOG_MUTEX_LOCK()   pthread_mutex_lock(&log_mutex)
+#define LOG_MUTEX_UNLOCK() pthread_mutex_unlock(&log_mutex)
 
-static char excluded_tags[MAX_EXCLUDED_TAGS][MAX_TAG_LENGTH];
-static int excluded_tag_count = 0;
-
-static wl_log_level_t global_log_level = WL_LOG_VERBOSE;
-
-typedef struct
-{
-    char tag[MAX_TAG_LENGTH];
-    wl_log_level_t level;
-} tag_log_level_t;
-
-static tag_log_level_t log_levels[MAX_LOG_LEVEL_TAGS];
-static int log_levels_count = 0;
-
-/* Circular buffer in case stdout is not available */
-typedef struct
-{
-    char data[WL_LOG_BUFFER_SIZE];
-    size_t head;
-    size_t tail;
-} log_buffer_t;
-
-static log_buffer_t log_buffer = {.head = 0, .tail = 0};
-
-/* Internal funcs */
-static int is_tag_excluded(const char *tag);
-static wl_log_level_t get_tag_level(const char *tag);
-static void log_output(const char *message);
+#else
+/* Spinlocks. Waiters pause between polls and, on hosts, yield once the backoff is exhausted */
+#ifndef WL_LOG_LOCK_SPIN_MAX
+#define WL_LOG_LOCK_SPIN_MAX 64  /* pauses before a waiter gives up its time slice */
+#endif
 
-/* Obtain time in ms */
-uint32_t get_millis()
+static inline void lock_pause(void)
 {
-#if defined(ARDUINO_ARCH_ESP32) || defined(ARDUINO_ARCH_ESP8266) || defined(ARDUINO_ARCH_RP2040) || defined(ARDUINO_ARCH_STM32) || defined(ARDUINO)
-    return millis();
-#elif defined(ESP32)
-    return (uint32_t)(esp_timer_get_time() / 1000);
-#elif defined(ESP8266)
-    return system_get_time() / 1000;
-#elif defined(RP2040)
-    return to_ms_since_boot(get_absolute_time());
-#elif defined(STM32F4) || defined(STM32F1) || defined(STM32F0) 
-    #ifdef HAL_GetTick
-        return HAL_GetTick(); 
-    #elif defined(FREERTOS)
-        return (uint32_t)(xTaskGetTickCount() * portTICK_PERIOD_MS); 
-    #else
-        #warning "No method to get millis defined for STM32 without HAL or FreeRTOS"
-        return 0; 
-    #endif
-
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || (defined(__arm__) && defined(__ARM_ARCH) && __ARM_ARCH >= 7)
+    __asm__ __volatile__("yield");
 #else
-    /* Default implementation using clock() function */
-    return (uint32_t)((clock() * 1000) / CLOCKS_PER_SEC);
+    __asm__ __volatile__("" ::: "memory");
 #endif
 }
 
-/*Init the library*/
-void wl_log_init(void)
+/* Pause for spins rounds, doubling up to WL_LOG_LOCK_SPIN_MAX, then yield */
+static inline void lock_backoff(uint32_t *spins)
 {
-#ifdef WL_LOG_USE_MUTEX
-#if defined(ESP32)
-    log_mutex = xSemaphoreCreateMutex();
-    if (log_mutex == NULL)
-    {
-        printf("Error: Muttex cannot be created. Rebooting...\n");
-        esp_restart();  
-    }
-
-#elif defined(RP2040) && defined(FREERTOS)
-    log_mutex = xSemaphoreCreateMutex();
-    if (log_mutex == NULL)
+    if (*spins < WL_LOG_LOCK_SPIN_MAX)
     {
-       printf("Error: Muttex cannot be created. Rebooting...\n");
-        watchdog_reboot(0, 0, 0);  
-    }
-
-#elif defined(STM32F4) || defined(STM32F1) || defined(STM32F0)
-    #ifdef HAL_GetTick
-        log_mutex = osMutexCreate(NULL);
-        if (log_mutex == NULL)
-        {
-            printf("Error: Muttex cannot be created. Rebooting...\n");
-            NVIC_SystemReset();  
-        }
-    #elif defined(FREERTOS)
-       
-        log_mutex = xSemaphoreCreateMutex();
-        if (log_mutex == NULL)
+        for (uint32_t i = 0; i < *spins; i++)
         {
-           printf("Error: Muttex cannot be created. Rebooting...\n");
-            NVIC_SystemReset(); 
+            lock_pause();
         }
-    #else
-        #warning "No method to create mutex defined for STM32 without HAL or FreeRTOS"
-    #endif
-
-
+        *spins *= 2;
+        return;
+    }
+#ifdef LOG_LOCK_HOSTED
+    sched_yield();
 #else
-    #warning "No mutex support defined for this platform"
-#endif
-#endif
-
-#ifdef WL_LOG_USE_UART
-    wl_log_uart_init();
+    lock_pause();
 #endif
 }
 
+#if WL_LOG_LOCK == WL_LOG_LOCK_TICKET
+/* Served in arrival order. Own cache lines, arrivals do not disturb the holder */
+static uint32_t log_lock_next __attribute__((aligned(64)));
+static uint32_t log_lock_owner __attribute__((aligned(64)));
 
-/* Internal func */
-void wl_log_print(wl_log_level_t level, const char *tag, const char *format, ...)
+static inline void log_lock_acquire(void)
 {
-    if (level > get_tag_level(tag) || is_tag_excluded(tag))
+    uint32_t ticket = __atomic_fetch_add(&log_lock_next, 1, __ATOMIC_RELAXED);
+    uint32_t spins = 1;
+    for (;;)
     {
-        return;
+        uint32_t ahead = ticket - __atomic_load_n(&log_lock_owner, __ATOMIC_ACQUIRE);
+        if (ahead == 0)
+        {
+            return;
+        }
+        /* Handed over in order, only the next in line keeps spinning */
+        if (ahead > 1)
+        {
+            spins = WL_LOG_LOCK_SPIN_MAX;
+        }
+        lock_backoff(&spins);
     }
+}
 
-    LOG_MUTEX_LOCK();
-
-    va_list args;
-    va_start(args, format);
-    char log_buffer_local[256];
-    vsnprintf(log_buffer_local, sizeof(log_buffer_local), format, args);
-    va_end(args);
+static inline void log_lock_release(void)
+{
+    __atomic_store_n(&log_lock_owner, log_lock_owner + 1, __ATOMIC_RELEASE);
+}
 
-    uint32_t millis = get_millis();
-    const char *level_str = "";
-    const char *color_code = ANSI_COLOR_WHITE;
-
-    switch (level)
-    {
-    case WL_LOG_ERROR:
-        level_str = "ERROR";
-        color_code = ANSI_COLOR_RED;
-        break;
-    case WL_LOG_WARN:
-        level_str = "WARN";
-        color_code = ANSI_COLOR_YELLOW;
-        break;
-    case WL_LOG_INFO:
-        level_str = "INFO";
-        color_code = ANSI_COLOR_GREEN;
-        break;
-    case WL_LOG_DEBUG:
-        level_str = "DEBUG";
-        color_code = ANSI_COLOR_BLUE;
-        break;
-    case WL_LOG_VERBOSE:
-        level_str = "VERBOSE";
-        color_code = ANSI_COLOR_WHITE;
-        break;
-    default:
-        level_str = "UNKNOWN";
-        break;
-    }
-
-    char final_message[512];
-    snprintf(final_message, sizeof(final_message), "%s(%u)[%s][%s]: %s%s\n", color_code, millis, level_str, tag, log_buffer_local, ANSI_COLOR_RESET);
-
-    log_output(final_message);
+#elif WL_LOG_LOCK == WL_LOG_LOCK_MCS
+/* Queue of waiters, each spins on its own thread-local node and is woken by its predecessor */
+typedef struct log_lock_node
+{
+    struct log_lock_node *next;
+    uint32_t locked;
+} log_lock_node_t;
 
-    LOG_MUTEX_UNLOCK();
-}
+static log_lock_node_t *log_lock_tail;
+static __thread log_lock_node_t log_lock_self;
 
-/* print hex func */
-void wl_log_buffer_hex(wl_log_level_t level, const char *tag, const uint8_t *buffer, size_t len)
+static inline void log_lock_acquire(void)
 {
-    if (level > get_tag_level(tag) || is_tag_excluded(tag))
+    log_lock_node_t *self = &log_lock_self;
+    self->next = NULL;
+    self->locked = 1;
+    log_lock_node_t *prev = __atomic_exchange_n(&log_lock_tail, self, __ATOMIC_ACQ_REL);
+    if (prev == NULL)
     {
         return;
     }
-
-    LOG_MUTEX_LOCK();
-
-    uint32_t millis = get_millis();
-    char header[128];
-    snprintf(header, sizeof(header), "(%u)[HEX][%s]: ", millis, tag);
-    log_output(header);
-
-    char hex_line[128];
-    for (size_t i = 0; i < len; i++)
+    __atomic_store_n(&prev->next, self, __ATOMIC_RELEASE);
+    uint32_t spins = 1;
+    while (__atomic_load_n(&self->locked, __ATOMIC_ACQUIRE))
     {
-        snprintf(hex_line, sizeof(hex_line), "%02X ", buffer[i]);
-        log_output(hex_line);
+        lock_backoff(&spins);
     }
-    log_output("\n");
-
-    LOG_MUTEX_UNLOCK();
 }
 
-/* dum func */
-void wl_log_dump(wl_log_level_t level, const char *tag, const void *buffer, size_t len)
+static inline void log_lock_release(void)
 {
-    if (level > get_tag_level(tag) || is_tag_excluded(tag))
-    {
-        return;
-    }
-
-    LOG_MUTEX_LOCK();
-
-    const uint8_t *buf = (const uint8_t *)buffer;
-    char header[128];
-    snprintf(header, sizeof(header), "(%u)[DUMP][%s]:\n", get_millis(), tag);
-    log_output(header);
-
-    char dump_line[128];
-    for (size_t i = 0; i < len; i++)
+    log_lock_node_t *self = &log_lock_self;
+    log_lock_node_t *next = __atomic_load_n(&self->next, __ATOMIC_ACQUIRE);
+    if (next == NULL)
     {
-        if (i % 16 == 0)
+        log_lock_node_t *expected = self;
+        if (__atomic_compare_exchange_n(&log_lock_tail, &expected, NULL, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        {
+            return;
+        }
+        /* A waiter swapped itself in but has not linked yet */
+        while ((next = __atomic_load_n(&self->next, __ATOMIC_ACQUIRE)) == NULL)
         {
-            snprintf(dump_line, sizeof(dump_line), "\n%04X: ", (unsigned int)i);
-            log_output(dump_line);
+            lock_pause();
         }
-        snprintf(dump_line, sizeof(dump_line), "%02X ", buf[i]);
-        log_output(dump_line);
     }
-    log_output("\n");
-
-    LOG_MUTEX_UNLOCK();
+    __atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
 }
 
-/* exclude tag func */
-void wl_log_exclude_tag(const char *tag)
-{
-    LOG_MUTEX_LOCK();
+#elif WL_LOG_LOCK == WL_LOG_LOCK_TAS
+/* Waiters poll with plain loads and only try the exchange once the lock looks free */
+static uint32_t log_lock;
 
-    if (excluded_tag_count < MAX_EXCLUDED_TAGS)
+static inline void log_lock_acquire(void)
+{
+    uint32_t spins = 1;
+    while (__atomic_exchange_n(&log_lock, 1, __ATOMIC_ACQUIRE))
     {
-        for (int i = 0; i < excluded_tag_count; i++)
+        do
         {
-            if (strncmp(excluded_tags[i], tag, MAX_TAG_LENGTH) == 0)
-            {
-                LOG_MUTEX_UNLOCK();
-                return; 
-            }
-        }
-        strncpy(excluded_tags[excluded_tag_count], tag, MAX_TAG_LENGTH - 1);
-        excluded_tags[excluded_tag_count][MAX_TAG_LENGTH - 1] = '\0';
-        excluded_tag_count++;
-    }
-    else
-    {
-        printf("Error: Tag list is full.\n");
+            lock_backoff(&spins);
+        } while (__atomic_load_n(&log_lock, __ATOMIC_RELAXED));
     }
-
-    LOG_MUTEX_UNLOCK();
 }
 
-/* insert new tag */
-void wl_log_include_tag(const char *tag)
+static inline void log_lock_release(void)
 {
-    LOG_MUTEX_LOCK();
+    __atomic_store_n(&log_lock, 0, __ATOMIC_RELEASE);
+}
 
-    for (int i = 0; i < excluded_tag_count; i++)
-    {
-        if (strncmp(excluded_tags[i], tag, MAX_TAG_LENGTH) == 0)
-        {
-            for (int j = i; j < excluded_tag_count - 1; j++)
-            {
-                strncpy(excluded_tags[j], excluded_tags[j + 1], MAX_TAG_LENGTH);
-            }
-            excluded_tag_count--;
-            LOG_MUTEX_UNLOCK();
-            return;
-        }
-    }
-    printf("Error: Tag not found in excluded list\n");
+#else
+#error "Unknown WL_LOG_LOCK, use one of the WL_LOG_LOCK_x values from wl_log.h"
+#endif
 
-    LOG_MUTEX_UNLOCK();
-}
+#define LOG_MUTEX_LOCK()   log_lock_acquire()
+#define LOG_MUTEX_UNLOCK() log_lock_release()
+#endif
 
-/* Adjust log level by tag */
-void wl_log_set_level(const char *tag, wl_log_level_t level)
-{
-    LOG_MUTEX_LOCK();
+#endif
+#else
+/*if not defined, void funcs*/
+#define LOG_MUTEX_LOCK()
+#define LOG_MUTEX_UNLOCK()
+#endif
 
-    for (int i = 0; i < log_levels_count; i++)
-    {
-        if (strncmp(log_levels[i].tag, tag, MAX_TAG_LENGTH) == 0)
-        {
-            log_levels[i].level = level;
-            LOG_MUTEX_UNLOCK();
-            return;
-        }
-    }
 
-    if (log_levels_count < MAX_LOG_LEVEL_TAGS)
-    {
-        strncpy(log_levels[log_levels_count].tag, tag, MAX_TAG_LENGTH - 1);
-        log_levels[log_levels_count].tag[MAX_TAG_LENGTH - 1] = '\0';
-        log_levels[log_levels_count].level = level;
-        log_levels_count++;
-    }
-    else
-    {
-        printf("Error: Log levels list is full\n");
-    }
+static wl_log_level_t global_log_level = WL_LOG_VERBOSE;
 
-    LOG_MUTEX_UNLOCK();
-}
+/* Registered sinks, only changed and called with the log mutex held */
+static const wl_log_sink_t *sinks[WL_LOG_MAX_SINKS] = {&wl_log_console_sink};
+static int sink_count = 1;
 
-/* Function to procces messages stored on circular buffer */
-void wl_log_process_buffer(void)
-{
-    LOG_MUTEX_LOCK();
+/* Timestamp source, see wl_log_set_clock */
+static wl_log_clock_t log_clock = wl_log_clock_monotonic;
 
-    while (log_buffer.tail != log_buffer.head)
-    {
-        char ch = log_buffer.data[log_buffer.tail];
-        log_output(&ch);
-        log_buffer.tail = (log_buffer.tail + 1) % WL_LOG_BUFFER_SIZE;
-    }
+/* Raw cycle counter stamps, turned into us only when a line is built */
+#ifdef WL_LOG_TIMESTAMP_CYCLES
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__aarch64__))
+#define LOG_STAMP_CYCLES
 
-    LOG_MUTEX_UNLOCK();
-}
+/* Busy wait of the x86 calibration in wl_log_init */
+#ifndef WL_LOG_CYCLES_CALIBRATION_US
+#define WL_LOG_CYCLES_CALIBRATION_US 10000
+#endif
+
+static uint64_t cycles_base;    /* counter at calibration */
+static uint64_t cycles_base_us; /* wl_log_clock_monotonic at calibration */
+static uint64_t cycles_mult;    /* us per tick, 32.32 fixed point */
+#else
+#warning "WL_LOG_TIMESTAMP_CYCLES needs x86_64 or AArch64, timestamps come from the clock"
+#endif
+#endif
+
+#ifdef WL_LOG_STATS
+/* Self statistics. Message counters are relaxed atomics, lock waits are kept in log_stamp units until read */
+static wl_log_stats_t log_stats;
+
+#define STATS_LEVEL(level) ((level) >= WL_LOG_ERROR && (level) <= WL_LOG_VERBOSE ? (size_t)(level) : 0)
+#define STATS_ADD(field, level, n) __atomic_fetch_add(&log_stats.field[STATS_LEVEL(level)], (uint32_t)(n), __ATOMIC_RELAXED)
+#define STATS_HIGH_WATER(used) stats_high_water((uint32_t)(used))
 
-/* internal func to evaluate if a tag is excluded*/
-static int is_tag_excluded(const char *tag)
+static inline uint64_t log_stamp(void);
+
+static void stats_high_water(uint32_t used)
 {
-    for (int i = 0; i < excluded_tag_count; i++)
+    uint32_t seen = __atomic_load_n(&log_stats.ring_high_water, __ATOMIC_RELAXED);
+    while (used > seen &&
+           !__atomic_compare_exchange_n(&log_stats.ring_high_water, &seen, used, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
     {
-        if (strncmp(excluded_tags[i], tag, MAX_TAG_LENGTH) == 0)
-        {
-            return 1;
-        }
     }
-    return 0;
 }
 
-/* internal func to obtain log level from tag*/
-static wl_log_level_t get_tag_level(const char *tag)
+#ifdef WL_LOG_USE_MUTEX
+/* Time every wait for the log mutex, the totals only change while it is held */
+static inline void stats_mutex_lock(void)
 {
-    for (int i = 0; i < log_levels_count; i++)
+    uint64_t start = log_stamp();
+    LOG_MUTEX_LOCK();
+    uint64_t wait = log_stamp() - start;
+    log_stats.lock_waits++;
+    log_stats.lock_wait_ns += wait;
+    if (wait > log_stats.lock_wait_max_ns)
     {
-        if (strncmp(log_levels[i].tag, tag, MAX_TAG_LENGTH) == 0)
-        {
-            return log_levels[i].level;
-        }
+        log_stats.lock_wait_max_ns = wait;
     }
-    return global_log_level;
 }
 
+#undef LOG_MUTEX_LOCK
+#define LOG_MUTEX_LOCK() stats_mutex_lock()
+#endif
+#else
+#define STATS_ADD(field, level, n) ((void)0)
+#define STATS_HIGH_WATER(used) ((void)0)
+#endif
 
-/* is stdout available? */
-static int stdout_available(void)
+/* Interned tags, a handle is the index in this table */
+typedef struct
 {
-#if defined(ESP32) || defined(ESP8266) || defined(RP2040) || defined(STM32F4) || defined(STM32F1) || defined(STM32F0)
-    return 1;  
+    char name[MAX_TAG_LENGTH];
+    wl_log_level_t level;
+    uint8_t excluded;
+} tag_entry_t;
 
-#elif defined(ARDUINO_ARCH_ESP32) || defined(ARDUINO_ARCH_ESP8266) || defined(ARDUINO_ARCH_RP2040) || defined(ARDUINO_ARCH_STM32) || defined(ARDUINO)
-    return 0;  
-#else
-    return 1;
+static tag_entry_t tag_table[WL_LOG_MAX_TAGS];
+static int tag_count = 0;
+
+/* Effective level per handle, WL_LOG_NONE when the tag is excluded */
+static uint8_t tag_threshold[WL_LOG_MAX_TAGS];
+
+/* handle + 1, 0 marks an empty slot */
+static uint16_t tag_index[WL_LOG_TAG_HASH_SIZE];
+
+#ifdef WL_LOG_RATE_LIMIT
+/* A flood is summed up at most this often per tag, a spared message or wl_log_flush reports at once */
+#ifndef WL_LOG_RATE_REPORT_MS
+#define WL_LOG_RATE_REPORT_MS 1000
 #endif
-}
 
-/*internal func*/
-static void log_output(const char *message)
+/*
+ * Token bucket per handle, kept as the theoretical arrival time of the next
+ * message (GCRA): a message passes while tat is at most tolerance ahead of
+ * now, and pushes tat one interval further. One compare and one add, no
+ * token refill loop. Updates race without the lock, at worst an extra
+ * message gets through.
+ */
+typedef struct
 {
-#ifdef WL_LOG_USE_UART
-    wl_log_uart_write(message);
-#else
-    if (stdout_available())
-    {
-        printf("%s", message);
-    }
-    else
-    {
-        size_t msg_len = strlen(message);
-        for (size_t i = 0; i < msg_len; i++)
-        {
-            size_t next_head = (log_buffer.head + 1) % WL_LOG_BUFFER_SIZE;
-            if (next_head != log_buffer.tail)
-            {
-                log_buffer.data[log_buffer.head] = message[i];
-                log_buffer.head = next_head;
-            }
-            else
-            {
-                #ifdef WL_LOG_BUFFER_OVERWRITE
-                    log_buffer.tail = (log_buffer.tail + 1) % WL_LOG_BUFFER_SIZE;
-                    log_buffer.data[log_buffer.head] = message[i];
-                    log_buffer.head = next_head;
-                #else
-                    break;
-                #endif
-            }
-        }
-    }
+    uint64_t tat;         /* us */
+    uint64_t reported;    /* us, last summary */
+    uint32_t interval;    /* us per message, 0 when unlimited */
+    uint32_t tolerance;   /* (burst - 1) * interval */
+    uint32_t suppressed;  /* since the last summary */
+    uint8_t level;        /* least severe level spared */
+    uint8_t held_level;   /* of the last message held back, for the summary */
+} rate_limit_t;
+
+static rate_limit_t rate_limits[WL_LOG_MAX_TAGS];
 #endif
+
+#ifdef WL_LOG_SAMPLING
+/* 1 in every messages of a tag and level passes. Counted without the lock, a race only shifts which one */
+typedef struct
+{
+    uint32_t every[WL_LOG_VERBOSE + 1];  /* 0 or 1 when not sampled */
+    uint32_t seen[WL_LOG_VERBOSE + 1];   /* messages offered since the last one kept */
+    uint32_t skipped;                    /* sampled out, see wl_log_get_sampled_out */
+} sampling_t;
+
+static sampling_t samplings[WL_LOG_MAX_TAGS];
+#endif
+
+#ifdef WL_LOG_COALESCE
+/* A run of identical messages is reported at the latest this long after its first repeat */
+#ifndef WL_LOG_COALESCE_TIMEOUT_MS
+#define WL_LOG_COALESCE_TIMEOUT_MS 5000
+#endif
+
+/*
+ * Last message that went out, repeats of it are only counted. One word updated with a CAS,
+ * no lock: the upper half of the FNV-1a hash of level, tag and body (or of the deferred
+ * arguments), a generation, a ready bit and the repeats not reported yet. Level and tag of
+ * the run sit in the slot of its generation behind a seqlock, written by whoever installed
+ * the message and read back for the summary before the CAS that ends the run.
+ */
+#define REPEAT_COUNT_MASK ((1ull << 28) - 1)
+#define REPEAT_READY (1ull << 28)   /* the slot is written, repeats may be counted */
+#define REPEAT_GEN_SHIFT 29
+#define REPEAT_SLOTS 8
+#define REPEAT_GEN(word) ((size_t)((word) >> REPEAT_GEN_SHIFT) & (REPEAT_SLOTS - 1))
+#define REPEAT_KEY(hash) ((hash) & 0xFFFFFFFF00000000ull)
+
+typedef struct
+{
+    uint32_t seq;    /* odd while level and tag are written */
+    uint64_t since;  /* us, first repeat not reported yet */
+    uint8_t level;
+    char tag[MAX_TAG_LENGTH];
+} repeat_slot_t;
+
+/* Level and tag of a run, as copied out of its slot */
+typedef struct
+{
+    uint8_t level;
+    char tag[MAX_TAG_LENGTH];
+} repeat_summary_t;
+
+static uint64_t repeat_word;
+static repeat_slot_t repeat_slots[REPEAT_SLOTS];
+#endif
+
+#ifdef WL_LOG_FLIGHT_RECORDER
+/* RAM kept for the history replayed ahead of an error */
+#ifndef WL_LOG_FLIGHT_SIZE
+#define WL_LOG_FLIGHT_SIZE 4096
+#endif
+
+/* This level and the less severe ones are only recorded */
+#ifndef WL_LOG_FLIGHT_LEVEL
+#define WL_LOG_FLIGHT_LEVEL WL_LOG_DEBUG
+#endif
+
+/* Replay at most this many records and this much history, 0 for no limit */
+#ifndef WL_LOG_FLIGHT_RECORDS
+#define WL_LOG_FLIGHT_RECORDS 0
+#endif
+#ifndef WL_LOG_FLIGHT_AGE_MS
+#define WL_LOG_FLIGHT_AGE_MS 0
+#endif
+
+/* Each record is a header then the exact bytes the sinks would have seen, wrapping freely */
+typedef struct
+{
+    uint64_t stamp;
+    uint32_t len;
+} flight_header_t;
+
+/* Overwrite ring, oldest records go first. Guarded by the log mutex */
+typedef struct
+{
+    char data[WL_LOG_FLIGHT_SIZE];
+    size_t head;     /* next byte written */
+    size_t tail;     /* oldest record */
+    size_t used;
+    uint32_t records;
+} flight_ring_t;
+
+static flight_ring_t flight_ring;
+static wl_log_level_t flight_level = WL_LOG_FLIGHT_LEVEL;
+static uint32_t flight_max_records = WL_LOG_FLIGHT_RECORDS;
+static uint32_t flight_max_age_ms = WL_LOG_FLIGHT_AGE_MS;
+#endif
+
+#ifdef WL_LOG_PERSIST
+/* Bytes of log history kept across resets, a power of two */
+#ifndef WL_LOG_PERSIST_SIZE
+#define WL_LOG_PERSIST_SIZE 8192
+#endif
+#if (WL_LOG_PERSIST_SIZE & (WL_LOG_PERSIST_SIZE - 1)) != 0
+#error "WL_LOG_PERSIST_SIZE must be a power of two"
+#endif
+#ifdef WL_LOG_DEFERRED
+/* Deferred records hold format pointers that mean nothing to the next run, they would be lost */
+#error "WL_LOG_PERSIST cannot be combined with WL_LOG_DEFERRED"
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+/* Hosts keep the ring in a shared file mapping, it outlives the process */
+#define PERSIST_MMAP
+#ifndef WL_LOG_PERSIST_PATH
+#define WL_LOG_PERSIST_PATH "wl_log.ring"
+#endif
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#else
+/* Boards keep it in RAM the startup code does not clear */
+#ifndef WL_LOG_PERSIST_SECTION
+#define WL_LOG_PERSIST_SECTION ".noinit"
+#endif
+#endif
+
+#define PERSIST_MAGIC 0x574C5052u        /* "WLPR" */
+#define PERSIST_RECORD_MAGIC 0x574C5243u /* "WLRC" */
+#define PERSIST_VERSION 1u
+
+/* Header of one record, followed by the bytes the sinks got, padded to 4 */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t len;
+    uint32_t check; /* FNV-1a of seq, len and the bytes */
+} persist_record_t;
+
+/* Producers reserve with one atomic add and never wait, a torn record fails its check */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t head;  /* bytes ever reserved, wraps with the ring */
+    uint32_t seq;   /* next record number */
+    uint32_t reserved;
+    char data[WL_LOG_PERSIST_SIZE];
+} persist_region_t;
+
+#ifdef PERSIST_MMAP
+static persist_region_t *persist;
+#else
+static persist_region_t persist_storage __attribute__((section(WL_LOG_PERSIST_SECTION)));
+static persist_region_t *persist;
+#endif
+#endif
+
+#ifdef WL_LOG_FILE
+/* File sink for POSIX hosts: the sink only copies, a helper thread rotates and syncs */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static wl_log_file_config_t file_config;
+static char file_path[256];
+static char *file_buffer;     /* guarded by the log mutex, like every sink */
+static size_t file_used;
+static uint64_t file_bytes;   /* in the current file */
+static int file_fd = -1;      /* only the helper thread replaces it, under the log mutex */
+static uint64_t file_lost;    /* bytes write(2) refused, until the helper thread reports them */
+static int file_errno;        /* of the last failed write */
+static int file_working;      /* the last write went through whole */
+
+/* Requests from the sink to the helper thread, guarded by file_mutex */
+static pthread_t file_thread;
+static pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t file_cond;
+static int file_rotate_request;
+static int file_sync_request;
+static int file_stop_request;
+static int file_running;
+#endif
+
+#ifdef WL_LOG_DEFERRED
+/* Deferred records are binary, only the record ring can carry them */
+#ifndef WL_LOG_BUFFER_LOCKFREE
+#define WL_LOG_BUFFER_LOCKFREE
+#endif
+#include "wl_log_format.h"
+
+/* Formats the decoder already knows, direct mapped by address */
+#ifndef WL_LOG_STREAM_FORMAT_CACHE
+#define WL_LOG_STREAM_FORMAT_CACHE 64
+#endif
+
+static int stream_enabled = 0;
+static int stream_started = 0;
+static const char *stream_formats[WL_LOG_STREAM_FORMAT_CACHE];
+static uint8_t stream_tags[(WL_LOG_MAX_TAGS + 7) / 8];
+#endif
+
+#ifdef WL_LOG_ASYNC
+/* The writer thread is the ring consumer, producers must never wait on it */
+#ifndef WL_LOG_BUFFER_LOCKFREE
+#define WL_LOG_BUFFER_LOCKFREE
+#endif
+#include <pthread.h>
+#include <errno.h>
+
+static pthread_t async_thread;
+static pthread_mutex_t async_mutex = PTHREAD_MUTEX_INITIALIZER;  /* guards async_cond */
+static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;  /* one consumer at a time */
+static pthread_cond_t async_cond;
+static wl_log_async_config_t async_config;
+static int async_running = 0;
+static int async_stop_request = 0;
+static int async_sleeping = 0;
+static int async_prev_buffered = -1;
+
+static void async_notify(wl_log_level_t level);
+#endif
+
+#ifdef WL_LOG_BUFFER_PER_THREAD
+/* Every thread (or core) owns a record ring, the drain merges them by timestamp */
+#ifndef WL_LOG_BUFFER_LOCKFREE
+#define WL_LOG_BUFFER_LOCKFREE
+#endif
+
+#if defined(ESP_PLATFORM) || defined(ARDUINO_ARCH_ESP32)
+/* One ring per core, tasks sharing a core still reserve with a CAS */
+#include "freertos/FreeRTOS.h"
+#define RING_THREADS portNUM_PROCESSORS
+#else
+/* One ring per thread, written with plain stores. Threads beyond the pool share ring 0 */
+#include <pthread.h>
+#ifndef WL_LOG_MAX_THREADS
+#define WL_LOG_MAX_THREADS 8
+#endif
+#define RING_THREADS WL_LOG_MAX_THREADS
+#define RING_SLOT_PRIVATE
+
+static pthread_key_t thread_ring_key;
+static pthread_once_t thread_ring_once = PTHREAD_ONCE_INIT;
+static __thread int thread_ring;  /* 0 unassigned, -1 pool exhausted, else the ring index */
+#endif
+
+#define RING_COUNT (1 + RING_THREADS)
+#else
+#define RING_COUNT 1
+#endif
+
+/* -1 follows stdout_available(), see wl_log_set_buffered */
+static int log_buffered = -1;
+
+#ifdef WL_LOG_BUFFER_LOCKFREE
+/*
+ * Lock-free multi-producer single-consumer ring of length-prefixed records.
+ * Positions run freely and wrap at 2^32, the offset in data is pos & (size - 1).
+ * A producer reserves header + payload with one CAS on head, copies its payload
+ * and publishes by storing pos + 1 in commit. The consumer stops at the first
+ * record not yet published, so output keeps reservation order. Consumed bytes
+ * are zeroed, a reserved but unwritten header can never look committed.
+ *
+ * With WL_LOG_BUFFER_PER_THREAD there are RING_COUNT such rings. Records
+ * carry their timestamp and the drain always takes the oldest head record,
+ * a k-way merge where each ring is already in order. Equal timestamps go
+ * by ring index, then ring order.
+ */
+#if (WL_LOG_BUFFER_SIZE & (WL_LOG_BUFFER_SIZE - 1)) != 0 || WL_LOG_BUFFER_SIZE < 64
+#error "WL_LOG_BUFFER_LOCKFREE needs a power of two WL_LOG_BUFFER_SIZE of at least 64"
+#endif
+
+#define RING_ALIGN 8u
+#define RING_MASK ((uint32_t)WL_LOG_BUFFER_SIZE - 1u)
+#define RING_RECORD_SIZE(len) ((uint32_t)(sizeof(ring_record_t) + (len) + RING_ALIGN - 1u) & ~(RING_ALIGN - 1u))
+
+/* Up to half the ring, so a record fits an empty ring whatever the wrap point */
+#define RING_MAX_PAYLOAD (WL_LOG_BUFFER_SIZE / 2 - 8 < 0xFFFF ? WL_LOG_BUFFER_SIZE / 2 - 8 : 0xFFFF)
+
+#define RING_KIND_TEXT 0      /* formatted text, written as is */
+#define RING_KIND_DEFERRED 1  /* deferred_header_t + packed args, formatted when drained */
+#define RING_KIND_PAD 0xFF    /* skip to the end of data */
+
+typedef struct
+{
+    uint16_t len;    /* payload bytes */
+    uint8_t kind;    /* RING_KIND_x */
+    uint8_t level;   /* of the message, lets the drain see ERROR lines */
+    uint32_t commit; /* reservation pos + 1 once the payload is written */
+#ifdef WL_LOG_BUFFER_PER_THREAD
+    uint64_t stamp;  /* merge key, same clock as log_stamp. Last, padding may only have 8 bytes */
+#endif
+} ring_record_t;
+
+typedef struct
+{
+    uint8_t data[WL_LOG_BUFFER_SIZE] __attribute__((aligned(RING_ALIGN)));
+    /* Own cache lines, neighbouring rings must not share them */
+    uint32_t head __attribute__((aligned(64))); /* next free pos, advanced by producers */
+    uint32_t tail __attribute__((aligned(64))); /* next pos to drain, advanced by the consumer only */
+#ifdef RING_SLOT_PRIVATE
+    uint8_t owned;  /* claimed by a thread, see ring_claim */
+#endif
+} log_buffer_t;
+
+static size_t ring_push(wl_log_level_t level, const wl_log_iovec_t *iov, size_t count, uint8_t kind, uint64_t stamp);
+static size_t ring_drain(size_t budget);
+#ifdef WL_LOG_ASYNC
+static uint32_t ring_pending(void);
+#endif
+#else
+/* Circular buffer in case stdout is not available */
+typedef struct
+{
+    char data[WL_LOG_BUFFER_SIZE];
+    size_t head;
+    size_t tail;
+    size_t error_end; /* bytes from tail to the end of the last ERROR line, 0 for none */
+} log_buffer_t;
+
+/* Wrap an index below 2 * WL_LOG_BUFFER_SIZE, a mask when the size is a power of two */
+#if (WL_LOG_BUFFER_SIZE & (WL_LOG_BUFFER_SIZE - 1)) == 0
+#define BYTE_RING_WRAP(i) ((i) & (WL_LOG_BUFFER_SIZE - 1))
+#else
+#define BYTE_RING_WRAP(i) ((i) >= WL_LOG_BUFFER_SIZE ? (i) - WL_LOG_BUFFER_SIZE : (i))
+#endif
+
+static size_t byte_ring_write(const char *data, size_t len);
+#endif
+
+#ifdef WL_LOG_BUFFER_LOCKFREE
+static log_buffer_t log_rings[RING_COUNT];
+#else
+static log_buffer_t log_buffer = {.head = 0, .tail = 0, .error_end = 0};
+#endif
+
+/* Internal funcs */
+static wl_log_tag_t find_tag(const char *tag);
+static wl_log_tag_t intern_tag(const char *tag);
+static int is_filtered(wl_log_level_t level, wl_log_tag_t handle);
+static int sample_admit(wl_log_level_t level, wl_log_tag_t handle);
+static int rate_admit(wl_log_level_t level, wl_log_tag_t handle);
+#ifdef WL_LOG_RATE_LIMIT
+static void rate_report(wl_log_tag_t handle, uint64_t now, int force);
+static void rate_flush(int force);
+#endif
+static int log_admit(wl_log_level_t level, wl_log_tag_t handle);
+static void stats_output(wl_log_level_t level, size_t dropped);
+#if defined(WL_LOG_RATE_LIMIT) || defined(WL_LOG_COALESCE) || defined(WL_LOG_LATENCY) || defined(WL_LOG_PERSIST) || defined(WL_LOG_FILE)
+static void log_notice(wl_log_level_t level, const char *tag, const char *format, ...) WL_LOG_PRINTF_FORMAT(3, 4);
+#endif
+#ifdef WL_LOG_COALESCE
+static uint64_t repeat_hash(uint64_t hash, const void *data, size_t len);
+static int repeat_suppress(wl_log_level_t level, const char *tag, uint64_t hash, uint64_t stamp);
+static void repeat_flush(int force);
+#endif
+#ifdef WL_LOG_FLIGHT_RECORDER
+static int flight_captures(wl_log_level_t level);
+static void flight_record(uint64_t stamp, const wl_log_iovec_t *iov, size_t count);
+static void flight_replay(void);
+#endif
+#ifdef WL_LOG_PERSIST
+static void persist_open(void);
+static void persist_write(const wl_log_iovec_t *iov, size_t count);
+#endif
+static void log_vprint(wl_log_level_t level, const char *tag, const char *format, va_list args);
+static void log_commit(wl_log_level_t level, uint64_t stamp, const char *line, size_t len);
+static size_t format_message(char *out, size_t *body_start, wl_log_level_t level, uint64_t stamp, const char *tag, const char *format, va_list args);
+static size_t format_header(char *out, wl_log_level_t level, uint64_t time, const char *tag);
+static size_t format_time(char *out, uint64_t time);
+#ifdef WL_LOG_DEFERRED
+static int deferred_push(wl_log_level_t level, wl_log_tag_t handle, const char *format, va_list args);
+static size_t deferred_render(char *out, const uint8_t *record, size_t len);
+static void stream_write(uint8_t kind, const uint8_t *record, size_t len);
+#endif
+static int is_buffered(void);
+static size_t log_output(wl_log_level_t level, const wl_log_iovec_t *iov, size_t count);
+static size_t log_output_span(wl_log_level_t level, const char *data, size_t len);
+static char *hex_encode(char *out, const uint8_t *data, size_t len);
+static size_t hex_offset(char *out, unsigned int offset);
+static size_t format_clip(int len, size_t size);
+static void output_lock(int *locked);
+static void sink_writev(const wl_log_iovec_t *iov, size_t count);
+static void sink_flush(void);
+static void sink_error_written(void);
+
+/* Widen a free running 32 bit microsecond counter, needs a call at least once per wrap */
+#if defined(ARDUINO_ARCH_ESP32) || defined(ARDUINO_ARCH_ESP8266) || defined(ARDUINO_ARCH_RP2040) || defined(ARDUINO_ARCH_STM32) || defined(ARDUINO) || defined(ESP8266)
+static uint64_t clock_widen(uint32_t now)
+{
+    static uint32_t last;
+    static uint64_t high;
+    if (now < last)
+    {
+        high += (uint64_t)1 << 32;
+    }
+    last = now;
+    return high | now;
+}
+#endif
+
+/* Obtain monotonic time in us */
+uint64_t wl_log_clock_monotonic(void)
+{
+#if defined(ARDUINO_ARCH_ESP32) || defined(ARDUINO_ARCH_ESP8266) || defined(ARDUINO_ARCH_RP2040) || defined(ARDUINO_ARCH_STM32) || defined(ARDUINO)
+    return clock_widen(micros());
+#elif defined(ESP32)
+    return (uint64_t)esp_timer_get_time();
+#elif defined(ESP8266)
+    return clock_widen(system_get_time());
+#elif defined(RP2040)
+    return to_us_since_boot(get_absolute_time());
+#elif defined(STM32F4) || defined(STM32F1) || defined(STM32F0) 
+    #ifdef HAL_GetTick
+        return (uint64_t)HAL_GetTick() * 1000u; 
+    #elif defined(FREERTOS)
+        return (uint64_t)xTaskGetTickCount() * portTICK_PERIOD_MS * 1000u; 
+    #else
+        #warning "No method to get time defined for STM32 without HAL or FreeRTOS"
+        return 0; 
+    #endif
+#elif defined(CLOCK_MONOTONIC)
+    /* POSIX hosts, wall time that never jumps */
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+#elif defined(__unix__) || defined(__APPLE__)
+#error "CLOCK_MONOTONIC is missing, clock() would measure CPU time instead of elapsed time"
+#else
+    /* Last resort on hosts without POSIX clocks, processor time */
+    return (uint64_t)clock() * 1000000u / CLOCKS_PER_SEC;
+#endif
+}
+
+/* Obtain time in us as cheaply as possible */
+uint64_t wl_log_clock_coarse(void)
+{
+#if defined(ARDUINO_ARCH_ESP32) || defined(ARDUINO_ARCH_ESP8266) || defined(ARDUINO_ARCH_RP2040) || defined(ARDUINO_ARCH_STM32) || defined(ARDUINO)
+    return (uint64_t)millis() * 1000u;
+#elif defined(CLOCK_MONOTONIC_COARSE)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+#else
+    return wl_log_clock_monotonic();
+#endif
+}
+
+/* Select the timestamp source */
+void wl_log_set_clock(wl_log_clock_t clock)
+{
+    log_clock = clock != NULL ? clock : wl_log_clock_monotonic;
+}
+
+#ifdef LOG_STAMP_CYCLES
+/* Free running cycle counter, no syscall and no HAL call */
+static inline uint64_t cycles_read(void)
+{
+#if defined(__x86_64__)
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+#else
+    uint64_t ticks;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#endif
+}
+
+/* Measure the counter frequency once, against the monotonic clock */
+static void cycles_calibrate(void)
+{
+    uint64_t frequency;
+#if defined(__x86_64__)
+    uint64_t start_us = wl_log_clock_monotonic();
+    uint64_t start = cycles_read();
+    uint64_t now_us;
+    do
+    {
+        now_us = wl_log_clock_monotonic();
+    } while (now_us - start_us < WL_LOG_CYCLES_CALIBRATION_US);
+    frequency = (cycles_read() - start) * 1000000u / (now_us - start_us);
+#else
+    /* The generic timer publishes its frequency */
+    __asm__ __volatile__("mrs %0, cntfrq_el0" : "=r"(frequency));
+#endif
+    if (frequency == 0)
+    {
+        frequency = 1;
+    }
+    cycles_base_us = wl_log_clock_monotonic();
+    cycles_base = cycles_read();
+    cycles_mult = ((uint64_t)1000000u << 32) / frequency;
+}
+#endif
+
+/* Timestamp as stored in records, raw cycles with WL_LOG_TIMESTAMP_CYCLES */
+static inline uint64_t log_stamp(void)
+{
+#ifdef LOG_STAMP_CYCLES
+    return cycles_read();
+#else
+    return log_clock();
+#endif
+}
+
+/* A stored timestamp in us */
+static inline uint64_t log_stamp_us(uint64_t stamp)
+{
+#ifdef LOG_STAMP_CYCLES
+    if (stamp < cycles_base)
+    {
+        return cycles_base_us;
+    }
+    return cycles_base_us + (uint64_t)(((unsigned __int128)(stamp - cycles_base) * cycles_mult) >> 32);
+#else
+    return stamp;
+#endif
+}
+
+#ifdef WL_LOG_LATENCY
+/* Log-linear histogram of call durations: one bucket per value below 16, then 16 per power of two */
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB (1u << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS ((33u - LATENCY_SUB_BITS) * LATENCY_SUB)
+
+#if !defined(LOG_STAMP_CYCLES) && (defined(__unix__) || defined(__APPLE__)) && defined(CLOCK_MONOTONIC)
+#define LATENCY_CLOCK_NS
+#endif
+
+/* Durations in latency_now units, saturated at 2^32 - 1 */
+typedef struct
+{
+    uint32_t counts[LATENCY_BUCKETS];
+    uint32_t max;
+} latency_hist_t;
+
+static latency_hist_t latency_hists[WL_LOG_VERBOSE];
+
+/* Started once a call is accepted, filtered calls cost the same as without WL_LOG_LATENCY */
+#define LATENCY_START(name) uint64_t name = latency_now()
+#define LATENCY_RECORD(level, start) latency_record(level, start)
+
+/* Fastest clock at hand: cycles, ns on POSIX hosts, us otherwise */
+static inline uint64_t latency_now(void)
+{
+#if defined(LOG_STAMP_CYCLES)
+    return cycles_read();
+#elif defined(LATENCY_CLOCK_NS)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#else
+    return wl_log_clock_monotonic();
+#endif
+}
+
+/* latency_now units to ns */
+static uint64_t latency_ns(uint64_t ticks)
+{
+#if defined(LOG_STAMP_CYCLES)
+    return (uint64_t)(((unsigned __int128)ticks * cycles_mult * 1000u) >> 32);
+#elif defined(LATENCY_CLOCK_NS)
+    return ticks;
+#else
+    return ticks * 1000u;
+#endif
+}
+
+static size_t latency_bucket(uint32_t value)
+{
+    if (value < LATENCY_SUB)
+    {
+        return value;
+    }
+    unsigned int shift = (unsigned int)(31 - __builtin_clz(value)) - LATENCY_SUB_BITS;
+    return (size_t)shift * LATENCY_SUB + (value >> shift);
+}
+
+/* Highest value counted in a bucket */
+static uint64_t latency_bucket_top(size_t bucket)
+{
+    if (bucket < LATENCY_SUB)
+    {
+        return bucket;
+    }
+    unsigned int shift = (unsigned int)(bucket / LATENCY_SUB) - 1;
+    uint64_t mantissa = LATENCY_SUB + bucket % LATENCY_SUB;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+/* Count one call that started at start, relaxed atomics only */
+static void latency_record(wl_log_level_t level, uint64_t start)
+{
+    if (level < WL_LOG_ERROR || level > WL_LOG_VERBOSE)
+    {
+        return;
+    }
+    uint64_t elapsed = latency_now() - start;
+    uint32_t value = elapsed < UINT32_MAX ? (uint32_t)elapsed : UINT32_MAX;
+    latency_hist_t *hist = &latency_hists[level - 1];
+
+    __atomic_fetch_add(&hist->counts[latency_bucket(value)], 1u, __ATOMIC_RELAXED);
+    uint32_t seen = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+    while (value > seen &&
+           !__atomic_compare_exchange_n(&hist->max, &seen, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+}
+#else
+#define LATENCY_START(name)
+#define LATENCY_RECORD(level, start) ((void)0)
+#endif
+
+/* Obtain time in ms, kept for code that declares it */
+uint32_t get_millis(void)
+{
+    return (uint32_t)(log_stamp_us(log_stamp()) / 1000u);
+}
+
+/*Init the library*/
+void wl_log_init(void)
+{
+#ifdef WL_LOG_USE_MUTEX
+#if defined(ESP32)
+    log_mutex = xSemaphoreCreateMutex();
+    if (log_mutex == NULL)
+    {
+        printf("Error: Muttex cannot be created. Rebooting...\n");
+        esp_restart();  
+    }
+
+#elif defined(RP2040) && defined(FREERTOS)
+    log_mutex = xSemaphoreCreateMutex();
+    if (log_mutex == NULL)
+    {
+       printf("Error: Muttex cannot be created. Rebooting...\n");
+        watchdog_reboot(0, 0, 0);  
+    }
+
+#elif defined(STM32F4) || defined(STM32F1) || defined(STM32F0)
+    #ifdef HAL_GetTick
+        log_mutex = osMutexCreate(NULL);
+        if (log_mutex == NULL)
+        {
+            printf("Error: Muttex cannot be created. Rebooting...\n");
+            NVIC_SystemReset();  
+        }
+    #elif defined(FREERTOS)
+       
+        log_mutex = xSemaphoreCreateMutex();
+        if (log_mutex == NULL)
+        {
+           printf("Error: Muttex cannot be created. Rebooting...\n");
+            NVIC_SystemReset(); 
+        }
+    #else
+        #warning "No method to create mutex defined for STM32 without HAL or FreeRTOS"
+    #endif
+
+
+#elif !defined(LOG_LOCK_STATIC)
+    #warning "No mutex support defined for this platform"
+#endif
+#endif
+
+#ifdef WL_LOG_USE_UART
+    wl_log_uart_init();
+#endif
+
+#ifdef LOG_STAMP_CYCLES
+    cycles_calibrate();
+#endif
+
+#ifdef WL_LOG_PERSIST
+    persist_open();
+#endif
+}
+
+
+/* Internal func */
+void wl_log_print(wl_log_level_t level, const char *tag, const char *format, ...)
+{
+    wl_log_tag_t handle = find_tag(tag);
+    if (!log_admit(level, handle))
+    {
+        return;
+    }
+    LATENCY_START(start);
+
+    va_list args;
+    va_start(args, format);
+#ifdef WL_LOG_DEFERRED
+    if (is_buffered() && deferred_push(level, handle, format, args))
+    {
+        va_end(args);
+        LATENCY_RECORD(level, start);
+        return;
+    }
+#endif
+    log_vprint(level, tag, format, args);
+    va_end(args);
+    LATENCY_RECORD(level, start);
+}
+
+/* Same as wl_log_print with an interned tag, no string lookup at all */
+void wl_log_print_tag(wl_log_level_t level, wl_log_tag_t tag, const char *format, ...)
+{
+    if (!log_admit(level, tag))
+    {
+        return;
+    }
+    LATENCY_START(start);
+
+    va_list args;
+    va_start(args, format);
+#ifdef WL_LOG_DEFERRED
+    if (is_buffered() && deferred_push(level, tag, format, args))
+    {
+        va_end(args);
+        LATENCY_RECORD(level, start);
+        return;
+    }
+#endif
+    log_vprint(level, tag >= 0 && tag < __atomic_load_n(&tag_count, __ATOMIC_ACQUIRE) ? tag_table[tag].name : "?", format, args);
+    va_end(args);
+    LATENCY_RECORD(level, start);
+}
+
+#if defined(WL_LOG_RATE_LIMIT) || defined(WL_LOG_COALESCE) || defined(WL_LOG_LATENCY) || defined(WL_LOG_PERSIST) || defined(WL_LOG_FILE)
+/* Message of the library itself, e.g. a suppression summary. Never coalesced */
+static void log_notice(wl_log_level_t level, const char *tag, const char *format, ...)
+{
+    char line[LOG_LINE_SIZE];
+    uint64_t stamp = log_stamp();
+    va_list args;
+    va_start(args, format);
+    size_t len = format_message(line, NULL, level, stamp, tag, format, args);
+    va_end(args);
+    log_commit(level, stamp, line, len);
+}
+#endif
+
+/* Format and emit one message, filtering is already done */
+static void log_vprint(wl_log_level_t level, const char *tag, const char *format, va_list args)
+{
+    /* Formatted on the caller's stack, other tasks are never held up by it */
+    char final_message[LOG_LINE_SIZE];
+    uint64_t stamp = log_stamp();
+    size_t body;
+    size_t len = format_message(final_message, &body, level, stamp, tag, format, args);
+
+#ifdef WL_LOG_COALESCE
+    /* Repeats of the previous message are only counted */
+    uint64_t hash = repeat_hash(14695981039346656037ull, &level, sizeof(level));
+    hash = repeat_hash(hash, tag, strlen(tag));
+    if (repeat_suppress(level, tag, repeat_hash(hash, final_message + body, len - body), stamp))
+    {
+        return;
+    }
+#endif
+
+    log_commit(level, stamp, final_message, len);
+}
+
+/* Send one formatted line, without its trailer, to the ring or the sinks */
+static void log_commit(wl_log_level_t level, uint64_t stamp, const char *line, size_t len)
+{
+    wl_log_iovec_t iov[2] = {{line, len}, {log_trailer, LOG_TRAILER_LEN}};
+
+#ifdef WL_LOG_FLIGHT_RECORDER
+    if (flight_captures(level))
+    {
+        LOG_MUTEX_LOCK();
+        flight_record(stamp, iov, 2);
+        LOG_MUTEX_UNLOCK();
+        return;
+    }
+    if (level == WL_LOG_ERROR)
+    {
+        /* The history goes out just ahead of the error */
+        wl_log_flight_trigger();
+    }
+#endif
+
+#ifdef WL_LOG_BUFFER_LOCKFREE
+    if (is_buffered())
+    {
+        /* Producers only touch their own reservation, no lock */
+#ifdef WL_LOG_PERSIST
+        persist_write(iov, 2);
+#endif
+        stats_output(level, ring_push(level, iov, 2, RING_KIND_TEXT, stamp));
+#ifdef WL_LOG_ASYNC
+        async_notify(level);
+#endif
+        return;
+    }
+#else
+    (void)stamp;
+#endif
+
+    /* The lock only covers the commit to the ring or the sinks */
+    LOG_MUTEX_LOCK();
+    size_t dropped = log_output(level, iov, 2);
+    LOG_MUTEX_UNLOCK();
+
+    stats_output(level, dropped);
+}
+
+/* Build "(millis)[LEVEL][tag]: message" into out (LOG_LINE_SIZE bytes), returns its length without the trailer.
+ * body_start gets the offset of the message after the header, may be NULL */
+static size_t format_message(char *out, size_t *body_start, wl_log_level_t level, uint64_t stamp, const char *tag, const char *format, va_list args)
+{
+    size_t len = format_header(out, level, log_stamp_us(stamp), tag);
+    if (body_start != NULL)
+    {
+        *body_start = len;
+    }
+
+    /* The body goes straight after the header, no intermediate copy */
+    int body = vsnprintf(out + len, LOG_BODY_SIZE, format, args);
+    if (body > 0)
+    {
+        len += (size_t)body < LOG_BODY_SIZE ? (size_t)body : LOG_BODY_SIZE - 1;
+    }
+    if (body >= (int)LOG_BODY_SIZE)
+    {
+        STATS_ADD(truncated, level, 1);
+    }
+    return len;
+}
+
+/* Color and "(millis)[LEVEL][tag]: ", at most LOG_HEADER_SIZE bytes */
+static size_t format_header(char *out, wl_log_level_t level, uint64_t time, const char *tag)
+{
+    static const char *const level_names[] = {"UNKNOWN", "ERROR", "WARN", "INFO", "DEBUG", "VERBOSE"};
+    static const char *const level_colors[] = {ANSI_COLOR_WHITE, ANSI_COLOR_RED, ANSI_COLOR_YELLOW,
+                                               ANSI_COLOR_GREEN, ANSI_COLOR_BLUE, ANSI_COLOR_WHITE};
+
+    size_t index = level >= WL_LOG_ERROR && level <= WL_LOG_VERBOSE ? (size_t)level : 0;
+    char *p = out;
+
+    for (const char *s = level_colors[index]; *s != '\0'; s++)
+    {
+        *p++ = *s;
+    }
+    p += format_time(p, time);
+    *p++ = '[';
+    for (const char *s = level_names[index]; *s != '\0'; s++)
+    {
+        *p++ = *s;
+    }
+    *p++ = ']';
+    *p++ = '[';
+    for (size_t i = 0; i < LOG_TAG_PRINT_MAX && tag[i] != '\0'; i++)
+    {
+        *p++ = tag[i];
+    }
+    *p++ = ']';
+    *p++ = ':';
+    *p++ = ' ';
+    return (size_t)(p - out);
+}
+
+/* print hex func */
+void wl_log_buffer_hex(wl_log_level_t level, const char *tag, const uint8_t *buffer, size_t len)
+{
+    wl_log_tag_t handle = find_tag(tag);
+    if (!log_admit(level, handle))
+    {
+        return;
+    }
+    LATENCY_START(start);
+#ifdef WL_LOG_FLIGHT_RECORDER
+    if (level == WL_LOG_ERROR)
+    {
+        wl_log_flight_trigger();
+    }
+#endif
+
+    /* Header and bytes share one line buffer, emitted when it fills up */
+    char line[LOG_LINE_SIZE];
+    size_t used = format_time(line, log_stamp_us(log_stamp()));
+    used += format_clip(snprintf(line + used, sizeof(line) - used, "[HEX][%s]: ", tag), sizeof(line) - used);
+
+    /* The lock is taken when the first full line goes out, short buffers only lock to commit */
+    int locked = 0;
+    size_t dropped = 0;
+    while (len > 0)
+    {
+        size_t room = (sizeof(line) - 1 - used) / 3;
+        if (room == 0)
+        {
+            output_lock(&locked);
+            dropped += log_output_span(level, line, used);
+            used = 0;
+            continue;
+        }
+        size_t count = len < room ? len : room;
+        used = (size_t)(hex_encode(line + used, buffer, count) - line);
+        buffer += count;
+        len -= count;
+    }
+    line[used++] = '\n';
+    output_lock(&locked);
+    dropped += log_output_span(level, line, used);
+
+    LOG_MUTEX_UNLOCK();
+
+    stats_output(level, dropped);
+
+#ifdef WL_LOG_ASYNC
+    async_notify(level);
+#endif
+    LATENCY_RECORD(level, start);
+}
+
+/* dum func */
+void wl_log_dump(wl_log_level_t level, const char *tag, const void *buffer, size_t len)
+{
+    wl_log_tag_t handle = find_tag(tag);
+    if (!log_admit(level, handle))
+    {
+        return;
+    }
+    LATENCY_START(start);
+#ifdef WL_LOG_FLIGHT_RECORDER
+    if (level == WL_LOG_ERROR)
+    {
+        wl_log_flight_trigger();
+    }
+#endif
+
+    const uint8_t *buf = (const uint8_t *)buffer;
+    char line[LOG_LINE_SIZE];
+    size_t used = format_time(line, log_stamp_us(log_stamp()));
+    used += format_clip(snprintf(line + used, sizeof(line) - used, "[DUMP][%s]:\n", tag), sizeof(line) - used);
+
+    /* Whole 16 byte rows are packed into the buffer, never split across writes */
+    int locked = 0;
+    size_t dropped = 0;
+    for (size_t i = 0; i < len; i += 16)
+    {
+        if (used + HEX_ROW_SIZE > sizeof(line))
+        {
+            output_lock(&locked);
+            dropped += log_output_span(level, line, used);
+            used = 0;
+        }
+        size_t count = len - i < 16 ? len - i : 16;
+        line[used++] = '\n';
+        used += hex_offset(line + used, (unsigned int)i);
+        line[used++] = ':';
+        line[used++] = ' ';
+        used = (size_t)(hex_encode(line + used, buf + i, count) - line);
+    }
+    output_lock(&locked);
+    if (used == sizeof(line))
+    {
+        dropped += log_output_span(level, line, used);
+        used = 0;
+    }
+    line[used++] = '\n';
+    dropped += log_output_span(level, line, used);
+
+    LOG_MUTEX_UNLOCK();
+
+    stats_output(level, dropped);
+
+#ifdef WL_LOG_ASYNC
+    async_notify(level);
+#endif
+    LATENCY_RECORD(level, start);
+}
+
+/* "(millis)" or "(millis.micros)" from a time in us, at most LOG_TIME_SIZE bytes */
+static size_t format_time(char *out, uint64_t time)
+{
+    char *p = out;
+    *p++ = '(';
+
+    uint64_t millis = time / 1000u;
+    char digits[20];
+    size_t count = 0;
+    do
+    {
+        digits[count++] = (char)('0' + millis % 10);
+        millis /= 10;
+    } while (millis != 0);
+    while (count > 0)
+    {
+        *p++ = digits[--count];
+    }
+
+#ifdef WL_LOG_TIMESTAMP_US
+    uint32_t micros = (uint32_t)(time % 1000u);
+    *p++ = '.';
+    *p++ = (char)('0' + micros / 100);
+    *p++ = (char)('0' + micros / 10 % 10);
+    *p++ = (char)('0' + micros % 10);
+#endif
+
+    *p++ = ')';
+    return (size_t)(p - out);
+}
+
+/* "XX " for every byte, returns the end of the written text */
+static char *hex_encode(char *out, const uint8_t *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        out[0] = hex_digits[data[i] >> 4];
+        out[1] = hex_digits[data[i] & 0x0F];
+        out[2] = ' ';
+        out += 3;
+    }
+    return out;
+}
+
+/* Same text as "%04X", returns the number of digits */
+static size_t hex_offset(char *out, unsigned int offset)
+{
+    size_t count = 4;
+    while (count < 2 * sizeof(offset) && (offset >> (4 * count)) != 0)
+    {
+        count++;
+    }
+    for (size_t i = count; i > 0; i--)
+    {
+        out[i - 1] = hex_digits[offset & 0x0F];
+        offset >>= 4;
+    }
+    return count;
+}
+
+/* Take the log mutex before the first part of a multi-part message goes out */
+static void output_lock(int *locked)
+{
+    if (!*locked)
+    {
+        LOG_MUTEX_LOCK();
+        *locked = 1;
+    }
+}
+
+/* Length snprintf actually left in a buffer of size bytes */
+static size_t format_clip(int len, size_t size)
+{
+    if (len < 0)
+    {
+        return 0;
+    }
+    return (size_t)len < size ? (size_t)len : size - 1;
+}
+
+/* Register a tag and get its handle */
+wl_log_tag_t wl_log_register_tag(const char *tag)
+{
+    LOG_MUTEX_LOCK();
+
+    wl_log_tag_t handle = intern_tag(tag);
+
+    LOG_MUTEX_UNLOCK();
+
+    return handle;
+}
+
+/* exclude tag func */
+void wl_log_exclude_tag(const char *tag)
+{
+    LOG_MUTEX_LOCK();
+
+    wl_log_tag_t handle = intern_tag(tag);
+    if (handle != WL_LOG_TAG_INVALID)
+    {
+        tag_table[handle].excluded = 1;
+        __atomic_store_n(&tag_threshold[handle], (uint8_t)WL_LOG_NONE, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        printf("Error: Tag list is full.\n");
+    }
+
+    LOG_MUTEX_UNLOCK();
+}
+
+/* insert new tag */
+void wl_log_include_tag(const char *tag)
+{
+    LOG_MUTEX_LOCK();
+
+    wl_log_tag_t handle = find_tag(tag);
+    if (handle != WL_LOG_TAG_INVALID && tag_table[handle].excluded)
+    {
+        tag_table[handle].excluded = 0;
+        __atomic_store_n(&tag_threshold[handle], (uint8_t)tag_table[handle].level, __ATOMIC_RELAXED);
+        LOG_MUTEX_UNLOCK();
+        return;
+    }
+    printf("Error: Tag not found in excluded list\n");
+
+    LOG_MUTEX_UNLOCK();
+}
+
+/* Adjust log level by tag */
+void wl_log_set_level(const char *tag, wl_log_level_t level)
+{
+    LOG_MUTEX_LOCK();
+
+    wl_log_tag_t handle = intern_tag(tag);
+    if (handle != WL_LOG_TAG_INVALID)
+    {
+        tag_table[handle].level = level;
+        if (!tag_table[handle].excluded)
+        {
+            __atomic_store_n(&tag_threshold[handle], (uint8_t)level, __ATOMIC_RELAXED);
+        }
+    }
+    else
+    {
+        printf("Error: Log levels list is full\n");
+    }
+
+    LOG_MUTEX_UNLOCK();
+}
+
+#ifdef WL_LOG_RATE_LIMIT
+/* Limit how often a tag may log */
+void wl_log_set_rate_limit(const char *tag, wl_log_level_t level, uint32_t per_second, uint32_t burst)
+{
+    LOG_MUTEX_LOCK();
+
+    wl_log_tag_t handle = intern_tag(tag);
+    if (handle != WL_LOG_TAG_INVALID)
+    {
+        rate_limit_t *limit = &rate_limits[handle];
+        uint32_t interval = per_second > 0 ? (per_second < 1000000u ? 1000000u / per_second : 1u) : 0u;
+        limit->tolerance = burst > 1 ? (burst - 1) * interval : 0;
+        limit->level = (uint8_t)level;
+        limit->tat = 0;
+        limit->reported = 0;
+        /* Written last, rate_admit only looks at a limit once interval is set */
+        __atomic_store_n(&limit->interval, interval, __ATOMIC_RELEASE);
+    }
+    else
+    {
+        printf("Error: Tag list is full\n");
+    }
+
+    LOG_MUTEX_UNLOCK();
+}
+#endif
+
+#ifdef WL_LOG_SAMPLING
+/* Keep one message in n of a tag */
+void wl_log_set_sampling(const char *tag, wl_log_level_t level, uint32_t n)
+{
+    LOG_MUTEX_LOCK();
+
+    wl_log_tag_t handle = intern_tag(tag);
+    if (handle != WL_LOG_TAG_INVALID)
+    {
+        if (level >= WL_LOG_ERROR && level <= WL_LOG_VERBOSE)
+        {
+            samplings[handle].seen[level] = 0;
+            __atomic_store_n(&samplings[handle].every[level], n, __ATOMIC_RELAXED);
+        }
+    }
+    else
+    {
+        printf("Error: Tag list is full\n");
+    }
+
+    LOG_MUTEX_UNLOCK();
+}
+
+/* Messages of a tag dropped by sampling so far */
+uint32_t wl_log_get_sampled_out(const char *tag)
+{
+    wl_log_tag_t handle = find_tag(tag);
+    if (handle == WL_LOG_TAG_INVALID)
+    {
+        return 0;
+    }
+    return __atomic_load_n(&samplings[handle].skipped, __ATOMIC_RELAXED);
+}
+#endif
+
+#ifdef WL_LOG_STATS
+/* Snapshot of the counters, lock waits in ns */
+void wl_log_get_stats(wl_log_stats_t *stats)
+{
+    LOG_MUTEX_LOCK();
+    *stats = log_stats;
+    LOG_MUTEX_UNLOCK();
+
+#ifdef LOG_STAMP_CYCLES
+    stats->lock_wait_ns = (uint64_t)(((unsigned __int128)stats->lock_wait_ns * cycles_mult * 1000u) >> 32);
+    stats->lock_wait_max_ns = (uint64_t)(((unsigned __int128)stats->lock_wait_max_ns * cycles_mult * 1000u) >> 32);
+#else
+    stats->lock_wait_ns *= 1000u;
+    stats->lock_wait_max_ns *= 1000u;
+#endif
+}
+
+/* Start counting from zero */
+void wl_log_reset_stats(void)
+{
+    LOG_MUTEX_LOCK();
+    memset(&log_stats, 0, sizeof(log_stats));
+    LOG_MUTEX_UNLOCK();
+}
+#endif
+
+#ifdef WL_LOG_LATENCY
+/* Percentiles from a relaxed copy of the histogram, reported as the top of their bucket */
+void wl_log_get_latency(wl_log_level_t level, wl_log_latency_t *latency)
+{
+    memset(latency, 0, sizeof(*latency));
+    if (level < WL_LOG_ERROR || level > WL_LOG_VERBOSE)
+    {
+        return;
+    }
+
+    latency_hist_t *hist = &latency_hists[level - 1];
+    uint32_t counts[LATENCY_BUCKETS];
+    uint64_t total = 0;
+    for (size_t i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        counts[i] = __atomic_load_n(&hist->counts[i], __ATOMIC_RELAXED);
+        total += counts[i];
+    }
+    latency->count = (uint32_t)total;
+    latency->max_ns = latency_ns(__atomic_load_n(&hist->max, __ATOMIC_RELAXED));
+    if (total == 0)
+    {
+        return;
+    }
+
+    /* Rank of each percentile, in thousandths */
+    static const uint32_t permille[3] = {500, 990, 999};
+    uint64_t *results[3] = {&latency->p50_ns, &latency->p99_ns, &latency->p999_ns};
+    size_t next = 0;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < LATENCY_BUCKETS && next < 3; i++)
+    {
+        seen += counts[i];
+        while (next < 3 && seen * 1000u >= total * permille[next])
+        {
+            uint64_t top = latency_ns(latency_bucket_top(i));
+            *results[next++] = top < latency->max_ns ? top : latency->max_ns;
+        }
+    }
+}
+
+/* "latency LEVEL: n=... p50=...ns ...", one line per level in use */
+void wl_log_print_latency(void)
+{
+    static const char *const level_names[] = {"ERROR", "WARN", "INFO", "DEBUG", "VERBOSE"};
+    for (int level = WL_LOG_ERROR; level <= WL_LOG_VERBOSE; level++)
+    {
+        wl_log_latency_t latency;
+        wl_log_get_latency((wl_log_level_t)level, &latency);
+        if (latency.count == 0)
+        {
+            continue;
+        }
+        log_notice(WL_LOG_INFO, "wl_log", "latency %s: n=%lu p50=%lluns p99=%lluns p99.9=%lluns max=%lluns",
+                   level_names[level - 1], (unsigned long)latency.count, (unsigned long long)latency.p50_ns,
+                   (unsigned long long)latency.p99_ns, (unsigned long long)latency.p999_ns,
+                   (unsigned long long)latency.max_ns);
+    }
+}
+
+/* Calls still running may land on either side of the reset */
+void wl_log_reset_latency(void)
+{
+    memset(latency_hists, 0, sizeof(latency_hists));
+}
+#endif
+
+#ifdef WL_LOG_FLIGHT_RECORDER
+/* Select what is only recorded and what gets replayed */
+void wl_log_set_flight_recorder(wl_log_level_t level, uint32_t records, uint32_t age_ms)
+{
+    LOG_MUTEX_LOCK();
+    flight_level = level;
+    flight_max_records = records;
+    flight_max_age_ms = age_ms;
+    LOG_MUTEX_UNLOCK();
+}
+
+/* Dump the recorded history now, as an error would */
+void wl_log_flight_trigger(void)
+{
+    LOG_MUTEX_LOCK();
+    flight_replay();
+    LOG_MUTEX_UNLOCK();
+}
+#endif
+
+/* Route messages to the circular buffer instead of stdout/UART */
+void wl_log_set_buffered(int enable)
+{
+    log_buffered = enable ? 1 : 0;
+}
+
+/* Function to procces messages stored on circular buffer */
+void wl_log_process_buffer(void)
+{
+    /* Everything stored now fits in the capacity of every ring together */
+#ifdef WL_LOG_BUFFER_LOCKFREE
+    wl_log_process_buffer_budget((size_t)RING_COUNT * WL_LOG_BUFFER_SIZE);
+#else
+    wl_log_process_buffer_budget(WL_LOG_BUFFER_SIZE);
+#endif
+}
+
+/* Drain up to budget bytes in one lock hold */
+size_t wl_log_process_buffer_budget(size_t budget)
+{
+    size_t drained;
+
+#ifdef WL_LOG_COALESCE
+    /* A run that went quiet is reported from the drain, nobody else may log again */
+    repeat_flush(0);
+#endif
+#ifdef WL_LOG_RATE_LIMIT
+    /* Same for a flood that stopped */
+    rate_flush(0);
+#endif
+#ifdef WL_LOG_ASYNC
+    pthread_mutex_lock(&drain_mutex);
+#endif
+    LOG_MUTEX_LOCK();
+
+#ifdef WL_LOG_BUFFER_LOCKFREE
+    drained = ring_drain(budget);
+#else
+    /* The backlog is at most two contiguous spans, before and after the wrap */
+    size_t tail = log_buffer.tail;
+    drained = BYTE_RING_WRAP(log_buffer.head + WL_LOG_BUFFER_SIZE - tail);
+    if (drained > budget)
+    {
+        drained = budget;
+    }
+    if (drained > 0)
+    {
+        size_t first = WL_LOG_BUFFER_SIZE - tail;
+        if (first > drained)
+        {
+            first = drained;
+        }
+        wl_log_iovec_t iov[2] = {{&log_buffer.data[tail], first}, {log_buffer.data, drained - first}};
+        sink_writev(iov, drained > first ? 2 : 1);
+        log_buffer.tail = BYTE_RING_WRAP(tail + drained);
+        if (log_buffer.error_end != 0)
+        {
+            int error = drained >= log_buffer.error_end;
+            log_buffer.error_end = error ? 0 : log_buffer.error_end - drained;
+            if (error)
+            {
+                sink_error_written();
+            }
+        }
+    }
+#endif
+
+    LOG_MUTEX_UNLOCK();
+#ifdef WL_LOG_ASYNC
+    pthread_mutex_unlock(&drain_mutex);
+#endif
+
+    return drained;
+}
+
+/* Drain the circular buffer and flush every sink */
+void wl_log_flush(void)
+{
+#ifdef WL_LOG_COALESCE
+    repeat_flush(1);
+#endif
+#ifdef WL_LOG_RATE_LIMIT
+    rate_flush(1);
+#endif
+    wl_log_process_buffer();
+
+    LOG_MUTEX_LOCK();
+    sink_flush();
+    LOG_MUTEX_UNLOCK();
+}
+
+/* Register one more sink */
+int wl_log_add_sink(const wl_log_sink_t *sink)
+{
+    int result = -1;
+
+    LOG_MUTEX_LOCK();
+
+    if (sink != NULL && sink->write != NULL && sink_count < WL_LOG_MAX_SINKS)
+    {
+        sinks[sink_count++] = sink;
+        result = 0;
+    }
+
+    LOG_MUTEX_UNLOCK();
+
+    return result;
+}
+
+/* Unregister a sink, the others keep their order */
+int wl_log_remove_sink(const wl_log_sink_t *sink)
+{
+    int result = -1;
+
+    LOG_MUTEX_LOCK();
+
+    for (int i = 0; i < sink_count; i++)
+    {
+        if (sinks[i] == sink)
+        {
+            memmove(&sinks[i], &sinks[i + 1], (size_t)(sink_count - i - 1) * sizeof(sinks[0]));
+            sink_count--;
+            result = 0;
+            break;
+        }
+    }
+
+    LOG_MUTEX_UNLOCK();
+
+    return result;
+}
+
+#ifdef WL_LOG_ASYNC
+/* Writer thread, the only place where buffered messages meet stdout */
+static void *async_writer(void *arg)
+{
+    (void)arg;
+    struct timespec last_flush;
+    clock_gettime(CLOCK_MONOTONIC, &last_flush);
+
+    pthread_mutex_lock(&async_mutex);
+    while (!async_stop_request)
+    {
+        pthread_mutex_unlock(&async_mutex);
+
+        uint32_t pending = ring_pending();
+        wl_log_process_buffer();
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (async_config.flush == WL_LOG_ASYNC_FLUSH_EACH && pending > 0)
+        {
+            LOG_MUTEX_LOCK();
+            sink_flush();
+            LOG_MUTEX_UNLOCK();
+        }
+        else if (async_config.flush == WL_LOG_ASYNC_FLUSH_PERIODIC &&
+                 (uint64_t)(now.tv_sec - last_flush.tv_sec) * 1000u + (uint64_t)((now.tv_nsec - last_flush.tv_nsec) / 1000000) >= async_config.flush_ms)
+        {
+            LOG_MUTEX_LOCK();
+            sink_flush();
+            LOG_MUTEX_UNLOCK();
+            last_flush = now;
+        }
+
+        pthread_mutex_lock(&async_mutex);
+
+        /* Producers signal only while we sleep, check again after announcing it */
+        __atomic_store_n(&async_sleeping, 1, __ATOMIC_SEQ_CST);
+        int skip = 0;
+        if (async_config.wake == WL_LOG_ASYNC_WAKE_EACH)
+        {
+            skip = ring_pending() > 0;
+        }
+        else if (async_config.wake == WL_LOG_ASYNC_WAKE_THRESHOLD)
+        {
+            skip = ring_pending() >= async_config.wake_bytes;
+        }
+
+        if (!skip && !async_stop_request)
+        {
+            struct timespec deadline = now;
+            deadline.tv_sec += async_config.period_ms / 1000u;
+            deadline.tv_nsec += (long)(async_config.period_ms % 1000u) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            while (__atomic_load_n(&async_sleeping, __ATOMIC_ACQUIRE) && !async_stop_request)
+            {
+                if (pthread_cond_timedwait(&async_cond, &async_mutex, &deadline) == ETIMEDOUT)
+                {
+                    break;
+                }
+            }
+        }
+        __atomic_store_n(&async_sleeping, 0, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&async_mutex);
+
+    wl_log_flush();
+    return NULL;
+}
+
+/* Wake the writer if the policy asks for it, ERROR always does */
+static void async_notify(wl_log_level_t level)
+{
+    if (!__atomic_load_n(&async_running, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+
+    if (level != WL_LOG_ERROR)
+    {
+        if (async_config.wake == WL_LOG_ASYNC_WAKE_PERIODIC ||
+            (async_config.wake == WL_LOG_ASYNC_WAKE_THRESHOLD && ring_pending() < async_config.wake_bytes))
+        {
+            return;
+        }
+    }
+
+    /* Only the producer that clears the flag pays for the signal */
+    if (__atomic_exchange_n(&async_sleeping, 0, __ATOMIC_SEQ_CST))
+    {
+        pthread_mutex_lock(&async_mutex);
+        pthread_cond_signal(&async_cond);
+        pthread_mutex_unlock(&async_mutex);
+    }
+}
+
+/* Start the writer thread, callers only enqueue from now on */
+int wl_log_async_start(const wl_log_async_config_t *config)
+{
+    static const wl_log_async_config_t defaults = WL_LOG_ASYNC_CONFIG_DEFAULT;
+
+    if (async_running)
+    {
+        return -1;
+    }
+
+    async_config = config != NULL ? *config : defaults;
+    if (async_config.period_ms == 0)
+    {
+        async_config.period_ms = defaults.period_ms;
+    }
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&async_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    async_prev_buffered = log_buffered;
+    log_buffered = 1;
+    async_stop_request = 0;
+    async_sleeping = 0;
+
+    if (pthread_create(&async_thread, NULL, async_writer, NULL) != 0)
+    {
+        log_buffered = async_prev_buffered;
+        pthread_cond_destroy(&async_cond);
+        printf("Error: Log writer thread cannot be created\n");
+        return -1;
+    }
+    __atomic_store_n(&async_running, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Stop the writer thread once everything queued so far is written */
+void wl_log_async_stop(void)
+{
+    if (!async_running)
+    {
+        return;
+    }
+
+    __atomic_store_n(&async_running, 0, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&async_mutex);
+    async_stop_request = 1;
+    pthread_cond_signal(&async_cond);
+    pthread_mutex_unlock(&async_mutex);
+
+    pthread_join(async_thread, NULL);
+    pthread_cond_destroy(&async_cond);
+    log_buffered = async_prev_buffered;
+
+    /* Anything enqueued while the thread was exiting */
+    wl_log_flush();
+}
+#endif
+
+#ifdef WL_LOG_FILE
+static uint64_t file_now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000u + (uint64_t)now.tv_nsec / 1000000u;
+}
+
+/* Hand work to the helper thread, rare: rotation and fsync requests only */
+static void file_wake(int *request)
+{
+    pthread_mutex_lock(&file_mutex);
+    *request = 1;
+    pthread_cond_signal(&file_cond);
+    pthread_mutex_unlock(&file_mutex);
+}
+
+/* The whole buffer in one write(2), log mutex held */
+static void file_write_out(void)
+{
+    size_t done = 0;
+    while (done < file_used)
+    {
+        ssize_t n = write(file_fd, file_buffer + done, file_used - done);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            /* Disk full or gone, the helper thread reports the loss */
+            file_errno = n < 0 ? errno : ENOSPC;
+            file_lost += file_used - done;
+            file_working = 0;
+            break;
+        }
+        done += (size_t)n;
+    }
+    if (file_used != 0 && done == file_used)
+    {
+        file_working = 1;
+    }
+    file_bytes += done;
+    file_used = 0;
+
+    if (file_config.max_bytes != 0 && file_bytes >= file_config.max_bytes &&
+        !__atomic_load_n(&file_rotate_request, __ATOMIC_RELAXED))
+    {
+        file_wake(&file_rotate_request);
+    }
+}
+
+/* Sink write, a memcpy unless the buffer is full */
+static void file_write(void *ctx, const wl_log_iovec_t *iov, size_t count)
+{
+    (void)ctx;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (iov[i].len > file_config.buffer_size - file_used)
+        {
+            file_write_out();
+        }
+        if (iov[i].len > file_config.buffer_size)
+        {
+            /* Larger than the whole buffer, goes through it in pieces */
+            for (size_t done = 0; done < iov[i].len; done += file_config.buffer_size)
+            {
+                size_t n = iov[i].len - done < file_config.buffer_size ? iov[i].len - done : file_config.buffer_size;
+                memcpy(file_buffer, iov[i].data + done, n);
+                file_used = n;
+                file_write_out();
+            }
+            continue;
+        }
+        memcpy(file_buffer + file_used, iov[i].data, iov[i].len);
+        file_used += iov[i].len;
+    }
+}
+
+static void file_flush(void *ctx)
+{
+    (void)ctx;
+    file_write_out();
+}
+
+static const wl_log_sink_t file_sink = {file_write, file_flush, NULL};
+
+/* path -> path.1 -> ... -> path.max_files, then a fresh path. Not called with the log mutex */
+static int file_rotate(void)
+{
+    char from[sizeof(file_path) + 16];
+    char to[sizeof(file_path) + 16];
+
+    if (file_config.max_files == 0)
+    {
+        unlink(file_path);
+    }
+    else
+    {
+        snprintf(to, sizeof(to), "%s.%lu", file_path, (unsigned long)file_config.max_files);
+        unlink(to);
+        for (uint32_t i = file_config.max_files; i > 1; i--)
+        {
+            snprintf(from, sizeof(from), "%s.%lu", file_path, (unsigned long)(i - 1));
+            snprintf(to, sizeof(to), "%s.%lu", file_path, (unsigned long)i);
+            rename(from, to);
+        }
+        snprintf(to, sizeof(to), "%s.1", file_path);
+        rename(file_path, to);
+    }
+
+    /* Writers keep appending to the renamed file until the swap */
+    int fd = open(file_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    LOG_MUTEX_LOCK();
+    int old = file_fd;
+    file_fd = fd;
+    file_bytes = 0;
+    LOG_MUTEX_UNLOCK();
+
+    if (file_config.fsync != WL_LOG_FILE_FSYNC_NEVER)
+    {
+        fsync(old);
+    }
+    close(old);
+    return 0;
+}
+
+/* Helper thread: rotation, fsync and periodic write out, never on a caller's path */
+static void *file_worker(void *arg)
+{
+    (void)arg;
+    uint64_t opened = file_now_ms();
+    uint64_t synced = opened;
+    uint64_t flushed = opened;
+    int failing = 0; /* a failure was reported, the total comes once writes work again */
+
+    /* Sleep no longer than the shortest interval in use */
+    uint32_t period = 1000;
+    uint32_t intervals[3] = {file_config.flush_ms, file_config.max_age_ms,
+                             file_config.fsync == WL_LOG_FILE_FSYNC_PERIODIC ? file_config.fsync_ms : 0};
+    for (size_t i = 0; i < 3; i++)
+    {
+        if (intervals[i] != 0 && intervals[i] < period)
+        {
+            period = intervals[i];
+        }
+    }
+
+    pthread_mutex_lock(&file_mutex);
+    while (!file_stop_request)
+    {
+        if (!file_rotate_request && !file_sync_request)
+        {
+            struct timespec deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_sec += period / 1000u;
+            deadline.tv_nsec += (long)(period % 1000u) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&file_cond, &file_mutex, &deadline);
+        }
+        int rotate = file_rotate_request;
+        int sync = file_sync_request;
+        file_sync_request = 0;
+        pthread_mutex_unlock(&file_mutex);
+
+        uint64_t now = file_now_ms();
+        LOG_MUTEX_LOCK();
+        if (file_config.flush_ms != 0 && now - flushed >= file_config.flush_ms)
+        {
+            file_write_out();
+            flushed = now;
+        }
+        int empty = file_bytes == 0 && file_used == 0;
+        int error = file_errno;
+        int working = file_working;
+        uint64_t lost = file_lost;
+        if (failing && working)
+        {
+            file_lost = 0;
+        }
+        LOG_MUTEX_UNLOCK();
+
+        /* Once per failure, the notices themselves are lost while it lasts */
+        if (!failing && lost != 0)
+        {
+            log_notice(WL_LOG_WARN, "wl_log", "writing %s failed (%s), output is lost", file_path, strerror(error));
+            failing = 1;
+        }
+        else if (failing && working)
+        {
+            log_notice(WL_LOG_WARN, "wl_log", "writing %s works again, %llu bytes were lost", file_path,
+                       (unsigned long long)lost);
+            failing = 0;
+        }
+
+        /* Old enough and not empty, an idle log does not leave a trail of empty files */
+        if (file_config.max_age_ms != 0 && now - opened >= file_config.max_age_ms && !empty)
+        {
+            rotate = 1;
+        }
+        if (rotate && file_rotate() == 0)
+        {
+            opened = now;
+        }
+        if (sync || (file_config.fsync == WL_LOG_FILE_FSYNC_PERIODIC && now - synced >= file_config.fsync_ms))
+        {
+            /* This thread is the only one that replaces file_fd */
+            fsync(file_fd);
+            synced = now;
+        }
+
+        pthread_mutex_lock(&file_mutex);
+        if (rotate)
+        {
+            file_rotate_request = 0;
+        }
+    }
+    pthread_mutex_unlock(&file_mutex);
+    return NULL;
+}
+
+/* Open or append to path and start sending every message to it */
+int wl_log_file_open(const char *path, const wl_log_file_config_t *config)
+{
+    static const wl_log_file_config_t defaults = WL_LOG_FILE_CONFIG_DEFAULT;
+
+    if (file_running || path == NULL || strlen(path) >= sizeof(file_path))
+    {
+        return -1;
+    }
+
+    file_config = config != NULL ? *config : defaults;
+    if (file_config.buffer_size == 0)
+    {
+        file_config.buffer_size = defaults.buffer_size;
+    }
+    if (file_config.fsync_ms == 0)
+    {
+        file_config.fsync_ms = defaults.fsync_ms;
+    }
+    strcpy(file_path, path);
+
+    file_fd = open(file_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (file_fd < 0)
+    {
+        return -1;
+    }
+    struct stat st;
+    file_bytes = fstat(file_fd, &st) == 0 ? (uint64_t)st.st_size : 0;
+    file_used = 0;
+    file_lost = 0;
+    file_errno = 0;
+    file_working = 1;
+    file_buffer = malloc(file_config.buffer_size);
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&file_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    file_rotate_request = 0;
+    file_sync_request = 0;
+    file_stop_request = 0;
+
+    if (file_buffer == NULL || pthread_create(&file_thread, NULL, file_worker, NULL) != 0)
+    {
+        pthread_cond_destroy(&file_cond);
+        free(file_buffer);
+        file_buffer = NULL;
+        close(file_fd);
+        file_fd = -1;
+        return -1;
+    }
+    file_running = 1;
+
+    if (wl_log_add_sink(&file_sink) != 0)
+    {
+        wl_log_file_close();
+        return -1;
+    }
+    return 0;
+}
+
+/* Stop the helper thread and leave a complete file behind */
+void wl_log_file_close(void)
+{
+    if (!file_running)
+    {
+        return;
+    }
+
+    wl_log_remove_sink(&file_sink);
+    LOG_MUTEX_LOCK();
+    file_running = 0; /* no more sync requests from sink_error_written */
+    LOG_MUTEX_UNLOCK();
+
+    pthread_mutex_lock(&file_mutex);
+    file_stop_request = 1;
+    pthread_cond_signal(&file_cond);
+    pthread_mutex_unlock(&file_mutex);
+    pthread_join(file_thread, NULL);
+    pthread_cond_destroy(&file_cond);
+
+    LOG_MUTEX_LOCK();
+    file_write_out();
+    LOG_MUTEX_UNLOCK();
+
+    if (file_config.fsync != WL_LOG_FILE_FSYNC_NEVER)
+    {
+        fsync(file_fd);
+    }
+    close(file_fd);
+    file_fd = -1;
+    free(file_buffer);
+    file_buffer = NULL;
+}
+#endif
+
+/* FNV-1a over the significant part of a tag */
+static uint32_t tag_hash(const char *tag)
+{
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < MAX_TAG_LENGTH - 1 && tag[i] != '\0'; i++)
+    {
+        hash = (hash ^ (uint8_t)tag[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/* internal func to resolve a tag string to its handle */
+static wl_log_tag_t find_tag(const char *tag)
+{
+    uint32_t slot = tag_hash(tag) & (WL_LOG_TAG_HASH_SIZE - 1);
+    uint16_t entry;
+    /* Acquire pairs with the release in intern_tag, the table entry is complete once its slot is seen */
+    while ((entry = __atomic_load_n(&tag_index[slot], __ATOMIC_ACQUIRE)) != 0)
+    {
+        wl_log_tag_t handle = (wl_log_tag_t)(entry - 1);
+        if (strncmp(tag_table[handle].name, tag, MAX_TAG_LENGTH - 1) == 0)
+        {
+            return handle;
+        }
+        slot = (slot + 1) & (WL_LOG_TAG_HASH_SIZE - 1);
+    }
+    return WL_LOG_TAG_INVALID;
+}
+
+/* internal func to add a tag to the table, caller holds the lock */
+static wl_log_tag_t intern_tag(const char *tag)
+{
+    wl_log_tag_t handle = find_tag(tag);
+    if (handle != WL_LOG_TAG_INVALID || tag_count >= WL_LOG_MAX_TAGS)
+    {
+        return handle;
+    }
+
+    handle = (wl_log_tag_t)tag_count;
+    strncpy(tag_table[handle].name, tag, MAX_TAG_LENGTH - 1);
+    tag_table[handle].name[MAX_TAG_LENGTH - 1] = '\0';
+    tag_table[handle].level = global_log_level;
+    tag_table[handle].excluded = 0;
+    __atomic_store_n(&tag_threshold[handle], (uint8_t)global_log_level, __ATOMIC_RELAXED);
+    __atomic_store_n(&tag_count, tag_count + 1, __ATOMIC_RELEASE);
+
+    /* Publish in the index last, lookups run without the lock */
+    uint32_t slot = tag_hash(tag) & (WL_LOG_TAG_HASH_SIZE - 1);
+    while (tag_index[slot] != 0)
+    {
+        slot = (slot + 1) & (WL_LOG_TAG_HASH_SIZE - 1);
+    }
+    __atomic_store_n(&tag_index[slot], (uint16_t)(handle + 1), __ATOMIC_RELEASE);
+
+    return handle;
+}
+
+/* internal func, one array index decides level and exclusion. Setters run under the lock, this does not */
+static int is_filtered(wl_log_level_t level, wl_log_tag_t handle)
+{
+    if (handle >= 0 && handle < __atomic_load_n(&tag_count, __ATOMIC_ACQUIRE))
+    {
+        return level > (wl_log_level_t)__atomic_load_n(&tag_threshold[handle], __ATOMIC_RELAXED);
+    }
+    return level > global_log_level;
+}
+
+
+/* Count a message that reached the output, dropped holds the bytes a full buffer lost */
+static void stats_output(wl_log_level_t level, size_t dropped)
+{
+#ifdef WL_LOG_STATS
+    if (dropped == 0)
+    {
+        STATS_ADD(emitted, level, 1);
+        return;
+    }
+    STATS_ADD(dropped, level, 1);
+    STATS_ADD(dropped_bytes, level, dropped);
+#else
+    (void)level;
+    (void)dropped;
+#endif
+}
+
+/* Level, sampling and rate limit in that order, all before any formatting. 0 when the message is dropped */
+static int log_admit(wl_log_level_t level, wl_log_tag_t handle)
+{
+    if (!is_filtered(level, handle) && sample_admit(level, handle) && rate_admit(level, handle))
+    {
+        return 1;
+    }
+    STATS_ADD(filtered, level, 1);
+    return 0;
+}
+
+/* 1 in n, decided by a counter, no random numbers and no division */
+static int sample_admit(wl_log_level_t level, wl_log_tag_t handle)
+{
+#ifdef WL_LOG_SAMPLING
+    if (handle < 0 || handle >= __atomic_load_n(&tag_count, __ATOMIC_ACQUIRE) || level < WL_LOG_ERROR || level > WL_LOG_VERBOSE)
+    {
+        return 1;
+    }
+    sampling_t *sampling = &samplings[handle];
+    uint32_t every = __atomic_load_n(&sampling->every[level], __ATOMIC_RELAXED);
+    if (every <= 1)
+    {
+        return 1;
+    }
+    /* The first message of every n passes */
+    uint32_t seen = __atomic_load_n(&sampling->seen[level], __ATOMIC_RELAXED);
+    __atomic_store_n(&sampling->seen[level], seen + 1 < every ? seen + 1 : 0, __ATOMIC_RELAXED);
+    if (seen == 0)
+    {
+        return 1;
+    }
+    __atomic_fetch_add(&sampling->skipped, 1, __ATOMIC_RELAXED);
+    return 0;
+#else
+    (void)level;
+    (void)handle;
+    return 1;
+#endif
+}
+
+/* Token bucket check right after the level check, before any formatting. 0 when the message is suppressed */
+static int rate_admit(wl_log_level_t level, wl_log_tag_t handle)
+{
+#ifdef WL_LOG_RATE_LIMIT
+    if (handle < 0 || handle >= __atomic_load_n(&tag_count, __ATOMIC_ACQUIRE))
+    {
+        return 1;
+    }
+    rate_limit_t *limit = &rate_limits[handle];
+    uint32_t interval = __atomic_load_n(&limit->interval, __ATOMIC_ACQUIRE);
+    if (interval == 0)
+    {
+        return 1;
+    }
+    if (level < (wl_log_level_t)limit->level)
+    {
+        /* A spared message, e.g. an error after a flood, comes after the count of what was held back */
+        rate_report(handle, log_stamp_us(log_stamp()), 1);
+        return 1;
+    }
+
+    /* The log clock, a coarse one ticks too slowly for intervals of a few ms */
+    uint64_t now = log_stamp_us(log_stamp());
+    uint64_t tat = limit->tat;
+    if (tat > now + limit->tolerance)
+    {
+        limit->held_level = (uint8_t)level;
+        __atomic_fetch_add(&limit->suppressed, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    limit->tat = (tat > now ? tat : now) + interval;
+
+    /* Account for what the bucket held back, once per report period while the flood goes on */
+    rate_report(handle, now, 0);
+    return 1;
+#else
+    (void)level;
+    (void)handle;
+    return 1;
+#endif
+}
+
+#ifdef WL_LOG_RATE_LIMIT
+/* Log "N messages suppressed" for a tag if it held anything back, not within a report period of the last one unless forced */
+static void rate_report(wl_log_tag_t handle, uint64_t now, int force)
+{
+    rate_limit_t *limit = &rate_limits[handle];
+    if (__atomic_load_n(&limit->suppressed, __ATOMIC_RELAXED) == 0 ||
+        (!force && now - __atomic_load_n(&limit->reported, __ATOMIC_RELAXED) < WL_LOG_RATE_REPORT_MS * 1000ull))
+    {
+        return;
+    }
+    __atomic_store_n(&limit->reported, now, __ATOMIC_RELAXED);
+    uint32_t suppressed = __atomic_exchange_n(&limit->suppressed, 0, __ATOMIC_RELAXED);
+    if (suppressed != 0)
+    {
+        log_notice((wl_log_level_t)limit->held_level, tag_table[handle].name, "%lu messages suppressed",
+                   (unsigned long)suppressed);
+    }
+}
+
+/* Report floods that stopped once their report period is over, or all of them when forced */
+static void rate_flush(int force)
+{
+    uint64_t now = log_stamp_us(log_stamp());
+    int count = __atomic_load_n(&tag_count, __ATOMIC_ACQUIRE);
+    for (wl_log_tag_t handle = 0; handle < count; handle++)
+    {
+        rate_report(handle, now, force);
+    }
+}
+#endif
+
+#ifdef WL_LOG_COALESCE
+/* FNV-1a, 64 bit so that two different messages practically never collide */
+static uint64_t repeat_hash(uint64_t hash, const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash = (hash ^ p[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+/* Seqlock writer, only the thread that installed the generation writes its slot */
+static void repeat_slot_write(repeat_slot_t *slot, wl_log_level_t level, const char *tag, uint64_t now)
+{
+    uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    __atomic_store_n(&slot->since, now, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->level, (uint8_t)level, __ATOMIC_RELAXED);
+    size_t i = 0;
+    for (; i < MAX_TAG_LENGTH - 1 && tag[i] != '\0'; i++)
+    {
+        __atomic_store_n(&slot->tag[i], tag[i], __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&slot->tag[i], '\0', __ATOMIC_RELAXED);
+
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Seqlock reader, 0 when the slot was being rewritten and the copy cannot be trusted */
+static int repeat_slot_read(repeat_slot_t *slot, repeat_summary_t *summary)
+{
+    uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1u)
+    {
+        return 0;
+    }
+    summary->level = __atomic_load_n(&slot->level, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < MAX_TAG_LENGTH; i++)
+    {
+        summary->tag[i] = __atomic_load_n(&slot->tag[i], __ATOMIC_RELAXED);
+    }
+    summary->tag[MAX_TAG_LENGTH - 1] = '\0';
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq;
+}
+
+/* 1 when the message repeats the previous one and is only counted */
+static int repeat_suppress(wl_log_level_t level, const char *tag, uint64_t hash, uint64_t stamp)
+{
+    uint64_t now = log_stamp_us(stamp);
+    uint64_t key = REPEAT_KEY(hash);
+    uint64_t word = __atomic_load_n(&repeat_word, __ATOMIC_ACQUIRE);
+    repeat_summary_t summary;
+
+    for (;;)
+    {
+        uint32_t pending = (uint32_t)(word & REPEAT_COUNT_MASK);
+        repeat_slot_t *slot = &repeat_slots[REPEAT_GEN(word)];
+        if (REPEAT_KEY(word) == key)
+        {
+            if (!(word & REPEAT_READY))
+            {
+                /* Installed a moment ago, the slot is not written yet */
+                return 0;
+            }
+            if (pending != 0 && pending != REPEAT_COUNT_MASK &&
+                now - __atomic_load_n(&slot->since, __ATOMIC_RELAXED) < WL_LOG_COALESCE_TIMEOUT_MS * 1000ull)
+            {
+                /* Same run, nothing to report yet */
+                if (__atomic_compare_exchange_n(&repeat_word, &word, word + 1, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                {
+                    STATS_ADD(filtered, level, 1);
+                    return 1;
+                }
+                continue;
+            }
+
+            /* First repeat, or a long run reported once per timeout */
+            if (pending != 0 && !repeat_slot_read(slot, &summary))
+            {
+                word = __atomic_load_n(&repeat_word, __ATOMIC_ACQUIRE);
+                continue;
+            }
+            if (__atomic_compare_exchange_n(&repeat_word, &word, (word & ~REPEAT_COUNT_MASK) + 1, 1, __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE))
+            {
+                __atomic_store_n(&slot->since, now, __ATOMIC_RELAXED);
+                if (pending != 0)
+                {
+                    log_notice((wl_log_level_t)summary.level, summary.tag, "last message repeated %lu times", (unsigned long)pending);
+                }
+                STATS_ADD(filtered, level, 1);
+                return 1;
+            }
+            continue;
+        }
+
+        /* A different message, repeats are compared to it from now on */
+        if (pending != 0 && !repeat_slot_read(slot, &summary))
+        {
+            word = __atomic_load_n(&repeat_word, __ATOMIC_ACQUIRE);
+            continue;
+        }
+        size_t gen = (REPEAT_GEN(word) + 1) & (REPEAT_SLOTS - 1);
+        uint64_t installed = key | (uint64_t)gen << REPEAT_GEN_SHIFT;
+        if (__atomic_compare_exchange_n(&repeat_word, &word, installed, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            /* The generation is ours alone until the ready bit is set */
+            repeat_slot_write(&repeat_slots[gen], level, tag, now);
+            __atomic_compare_exchange_n(&repeat_word, &installed, installed | REPEAT_READY, 0, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED);
+            if (pending != 0)
+            {
+                log_notice((wl_log_level_t)summary.level, summary.tag, "last message repeated %lu times", (unsigned long)pending);
+            }
+            return 0;
+        }
+    }
+}
+
+/* Report a run once the timeout has passed without another message, or right away when forced */
+static void repeat_flush(int force)
+{
+    uint64_t word = __atomic_load_n(&repeat_word, __ATOMIC_ACQUIRE);
+    uint32_t pending = (uint32_t)(word & REPEAT_COUNT_MASK);
+    repeat_slot_t *slot = &repeat_slots[REPEAT_GEN(word)];
+    if (pending == 0 ||
+        (!force && log_stamp_us(log_stamp()) - __atomic_load_n(&slot->since, __ATOMIC_RELAXED) < WL_LOG_COALESCE_TIMEOUT_MS * 1000ull))
+    {
+        return;
+    }
+
+    /* A producer that got in first reports the run itself, a slot being rewritten waits for the next drain */
+    repeat_summary_t summary;
+    if (repeat_slot_read(slot, &summary) &&
+        __atomic_compare_exchange_n(&repeat_word, &word, word & ~REPEAT_COUNT_MASK, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        log_notice((wl_log_level_t)summary.level, summary.tag, "last message repeated %lu times", (unsigned long)pending);
+    }
+}
+#endif
+
+/* is stdout available? */
+static int stdout_available(void)
+{
+#if defined(ESP32) || defined(ESP8266) || defined(RP2040) || defined(STM32F4) || defined(STM32F1) || defined(STM32F0)
+    return 1;  
+
+#elif defined(ARDUINO_ARCH_ESP32) || defined(ARDUINO_ARCH_ESP8266) || defined(ARDUINO_ARCH_RP2040) || defined(ARDUINO_ARCH_STM32) || defined(ARDUINO)
+    return 0;  
+#else
+    return 1;
+#endif
+}
+
+/* buffered unless stdout is there, UART output is never buffered by default */
+static int is_buffered(void)
+{
+    if (log_buffered >= 0)
+    {
+        return log_buffered;
+    }
+#ifdef WL_LOG_USE_UART
+    return 0;
+#else
+    return !stdout_available();
+#endif
+}
+
+/* Console sink, every span straight to UART or stdout */
+static void console_write(void *ctx, const wl_log_iovec_t *iov, size_t count)
+{
+    (void)ctx;
+    for (size_t i = 0; i < count; i++)
+    {
+#ifdef WL_LOG_USE_UART
+        /* wl_log_uart_write wants a string, send it in terminated chunks */
+        const char *data = iov[i].data;
+        size_t len = iov[i].len;
+        char chunk[64];
+        while (len > 0)
+        {
+            size_t n = len < sizeof(chunk) - 1 ? len : sizeof(chunk) - 1;
+            memcpy(chunk, data, n);
+            chunk[n] = '\0';
+            wl_log_uart_write(chunk);
+            data += n;
+            len -= n;
+        }
+#else
+        fwrite(iov[i].data, 1, iov[i].len, stdout);
+#endif
+    }
+}
+
+/* push whatever stdout or the UART driver still holds */
+static void console_flush(void *ctx)
+{
+    (void)ctx;
+#ifndef WL_LOG_USE_UART
+    fflush(stdout);
+#endif
+}
+
+const wl_log_sink_t wl_log_console_sink = {console_write, console_flush, NULL};
+
+/* Hand the spans of one message to every sink, log mutex held */
+static void sink_writev(const wl_log_iovec_t *iov, size_t count)
+{
+    for (int i = 0; i < sink_count; i++)
+    {
+        sinks[i]->write(sinks[i]->ctx, iov, count);
+    }
+}
+
+/* Flush every sink that can, log mutex held */
+static void sink_flush(void)
+{
+    for (int i = 0; i < sink_count; i++)
+    {
+        if (sinks[i]->flush != NULL)
+        {
+            sinks[i]->flush(sinks[i]->ctx);
+        }
+    }
+}
+
+/* An ERROR line has just been handed to the sinks, log mutex held */
+static void sink_error_written(void)
+{
+#ifdef WL_LOG_FILE
+    if (file_running && file_config.fsync == WL_LOG_FILE_FSYNC_ERROR)
+    {
+        /* The kernel gets it now, the disk as soon as the helper thread runs */
+        file_write_out();
+        file_wake(&file_sync_request);
+    }
+#endif
+}
+
+/*internal func, returns the bytes lost to a full buffer*/
+static size_t log_output(wl_log_level_t level, const wl_log_iovec_t *iov, size_t count)
+{
+    size_t dropped = 0;
+#ifdef WL_LOG_PERSIST
+    persist_write(iov, count);
+#endif
+    if (!is_buffered())
+    {
+        sink_writev(iov, count);
+        if (level == WL_LOG_ERROR)
+        {
+            sink_error_written();
+        }
+    }
+    else
+    {
+#ifdef WL_LOG_BUFFER_LOCKFREE
+        dropped = ring_push(level, iov, count, RING_KIND_TEXT, log_stamp());
+#else
+        for (size_t span = 0; span < count; span++)
+        {
+            dropped += byte_ring_write(iov[span].data, iov[span].len);
+        }
+        if (level == WL_LOG_ERROR)
+        {
+            log_buffer.error_end = BYTE_RING_WRAP(log_buffer.head + WL_LOG_BUFFER_SIZE - log_buffer.tail);
+        }
+#endif
+    }
+    return dropped;
+}
+
+#ifndef WL_LOG_BUFFER_LOCKFREE
+/* Copy one span into the byte ring with at most two memcpy, log mutex held. Returns the bytes dropped */
+static size_t byte_ring_write(const char *data, size_t len)
+{
+    size_t head = log_buffer.head;
+    size_t tail = log_buffer.tail;
+    size_t room = WL_LOG_BUFFER_SIZE - 1 - BYTE_RING_WRAP(head + WL_LOG_BUFFER_SIZE - tail);
+    size_t dropped = 0;
+
+    if (len > room)
+    {
+#ifdef WL_LOG_BUFFER_OVERWRITE
+        /* Drop the oldest bytes, only the end of an oversized span fits */
+        if (len > WL_LOG_BUFFER_SIZE - 1)
+        {
+            dropped = len - (WL_LOG_BUFFER_SIZE - 1);
+            data += dropped;
+            len = WL_LOG_BUFFER_SIZE - 1;
+        }
+        log_buffer.tail = BYTE_RING_WRAP(tail + (len - room));
+        log_buffer.error_end = log_buffer.error_end > len - room ? log_buffer.error_end - (len - room) : 0;
+#else
+        /* Keep what fits, the rest of the message is dropped */
+        dropped = len - room;
+        len = room;
+#endif
+    }
+
+    size_t first = WL_LOG_BUFFER_SIZE - head;
+    if (first > len)
+    {
+        first = len;
+    }
+    memcpy(&log_buffer.data[head], data, first);
+    memcpy(log_buffer.data, data + first, len - first);
+    log_buffer.head = BYTE_RING_WRAP(head + len);
+    STATS_HIGH_WATER(BYTE_RING_WRAP(log_buffer.head + WL_LOG_BUFFER_SIZE - log_buffer.tail));
+    return dropped;
+}
+#endif
+
+/* log_output for text already in one buffer */
+static size_t log_output_span(wl_log_level_t level, const char *data, size_t len)
+{
+    wl_log_iovec_t iov = {data, len};
+#ifdef WL_LOG_FLIGHT_RECORDER
+    if (flight_captures(level))
+    {
+        flight_record(log_stamp(), &iov, 1);
+        return 0;
+    }
+#else
+    (void)level;
+#endif
+    return log_output(level, &iov, 1);
+}
+
+#ifdef WL_LOG_FLIGHT_RECORDER
+/* Level only goes to the recorder */
+static int flight_captures(wl_log_level_t level)
+{
+    wl_log_level_t threshold = flight_level;
+    return threshold != WL_LOG_NONE && level >= threshold;
+}
+
+/* Copy len bytes in at the ring position at, returns the position after them */
+static size_t flight_put(size_t at, const void *data, size_t len)
+{
+    size_t first = WL_LOG_FLIGHT_SIZE - at < len ? WL_LOG_FLIGHT_SIZE - at : len;
+    memcpy(flight_ring.data + at, data, first);
+    memcpy(flight_ring.data, (const char *)data + first, len - first);
+    return (at + len) % WL_LOG_FLIGHT_SIZE;
+}
+
+static size_t flight_get(size_t at, void *data, size_t len)
+{
+    size_t first = WL_LOG_FLIGHT_SIZE - at < len ? WL_LOG_FLIGHT_SIZE - at : len;
+    memcpy(data, flight_ring.data + at, first);
+    memcpy((char *)data + first, flight_ring.data, len - first);
+    return (at + len) % WL_LOG_FLIGHT_SIZE;
+}
+
+/* Drop the oldest record */
+static void flight_evict(void)
+{
+    flight_header_t header;
+    flight_get(flight_ring.tail, &header, sizeof(header));
+    flight_ring.tail = (flight_ring.tail + sizeof(header) + header.len) % WL_LOG_FLIGHT_SIZE;
+    flight_ring.used -= sizeof(header) + header.len;
+    flight_ring.records--;
+}
+
+/* Store one message in place of sending it, log mutex held. Only memcpy, no sink is touched */
+static void flight_record(uint64_t stamp, const wl_log_iovec_t *iov, size_t count)
+{
+    flight_header_t header = {stamp, 0};
+    for (size_t i = 0; i < count; i++)
+    {
+        header.len += (uint32_t)iov[i].len;
+    }
+    if (sizeof(header) + header.len > WL_LOG_FLIGHT_SIZE)
+    {
+        return;
+    }
+    while (flight_ring.used + sizeof(header) + header.len > WL_LOG_FLIGHT_SIZE)
+    {
+        flight_evict();
+    }
+
+    size_t at = flight_put(flight_ring.head, &header, sizeof(header));
+    for (size_t i = 0; i < count; i++)
+    {
+        at = flight_put(at, iov[i].data, iov[i].len);
+    }
+    flight_ring.head = at;
+    flight_ring.used += sizeof(header) + header.len;
+    flight_ring.records++;
+}
+
+/* Send the records inside the configured window on, oldest first, and empty the ring. Log mutex held */
+static void flight_replay(void)
+{
+    uint64_t now = log_stamp_us(log_stamp());
+    while (flight_ring.records > 0)
+    {
+        flight_header_t header;
+        size_t body = flight_get(flight_ring.tail, &header, sizeof(header));
+        int stale = (flight_max_records != 0 && flight_ring.records > flight_max_records) ||
+                    (flight_max_age_ms != 0 && now - log_stamp_us(header.stamp) > flight_max_age_ms * 1000ull);
+        if (!stale)
+        {
+            /* Straight from the ring, in two pieces when the record wraps */
+            size_t first = WL_LOG_FLIGHT_SIZE - body < header.len ? WL_LOG_FLIGHT_SIZE - body : header.len;
+            wl_log_iovec_t iov[2] = {{flight_ring.data + body, first}, {flight_ring.data, header.len - first}};
+            log_output(WL_LOG_NONE, iov, 2); /* history, never an ERROR line */
+        }
+        flight_evict();
+    }
+    flight_ring.head = flight_ring.tail = 0;
+}
+#endif
+
+#ifdef WL_LOG_PERSIST
+static uint32_t persist_hash(uint32_t hash, const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash = (hash ^ p[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/* Copy in or out at a ring position, in two pieces when it wraps */
+static void persist_put(persist_region_t *region, uint32_t at, const void *data, size_t len)
+{
+    at &= WL_LOG_PERSIST_SIZE - 1;
+    size_t first = WL_LOG_PERSIST_SIZE - at < len ? WL_LOG_PERSIST_SIZE - at : len;
+    memcpy(region->data + at, data, first);
+    memcpy(region->data, (const char *)data + first, len - first);
+}
+
+static void persist_get(const persist_region_t *region, uint32_t at, void *data, size_t len)
+{
+    at &= WL_LOG_PERSIST_SIZE - 1;
+    size_t first = WL_LOG_PERSIST_SIZE - at < len ? WL_LOG_PERSIST_SIZE - at : len;
+    memcpy(data, region->data + at, first);
+    memcpy((char *)data + first, region->data, len - first);
+}
+
+/* Append one message, any task, no lock */
+static void persist_write(const wl_log_iovec_t *iov, size_t count)
+{
+    persist_region_t *region = persist;
+    if (region == NULL)
+    {
+        return;
+    }
+
+    persist_record_t record = {PERSIST_RECORD_MAGIC, 0, 0, 0};
+    for (size_t i = 0; i < count; i++)
+    {
+        record.len += (uint32_t)iov[i].len;
+    }
+    uint32_t total = (uint32_t)(sizeof(record) + record.len + 3u) & ~3u;
+    if (total > WL_LOG_PERSIST_SIZE)
+    {
+        return;
+    }
+
+    uint32_t at = __atomic_fetch_add(&region->head, total, __ATOMIC_RELAXED);
+    record.seq = __atomic_fetch_add(&region->seq, 1u, __ATOMIC_RELAXED);
+    record.check = persist_hash(2166136261u, &record.seq, 2 * sizeof(uint32_t));
+
+    uint32_t body = at + (uint32_t)sizeof(record);
+    for (size_t i = 0; i < count; i++)
+    {
+        record.check = persist_hash(record.check, iov[i].data, iov[i].len);
+        persist_put(region, body, iov[i].data, iov[i].len);
+        body += (uint32_t)iov[i].len;
+    }
+    persist_put(region, at, &record, sizeof(record));
+}
+
+/* Send what a valid previous ring holds to the sinks, oldest first. Returns the records found */
+static uint32_t persist_recover(const persist_region_t *region, uint32_t *first_seq, uint32_t *last_seq)
+{
+    if (region->magic != PERSIST_MAGIC || region->version != PERSIST_VERSION || region->size != WL_LOG_PERSIST_SIZE)
+    {
+        return 0;
+    }
+
+    /* Record starts are unknown, resynchronize on the record magic every 4 bytes */
+    uint32_t head = region->head;
+    uint32_t at = head - (head < WL_LOG_PERSIST_SIZE ? head : WL_LOG_PERSIST_SIZE);
+    uint32_t found = 0;
+    char line[LOG_LINE_SIZE + LOG_TRAILER_LEN];
+    while (head - at >= sizeof(persist_record_t))
+    {
+        persist_record_t record;
+        persist_get(region, at, &record, sizeof(record));
+        uint32_t room = head - at - (uint32_t)sizeof(record);
+        if (record.magic == PERSIST_RECORD_MAGIC && record.len <= room && record.len <= sizeof(line) &&
+            (found == 0 || record.seq > *last_seq))
+        {
+            persist_get(region, at + (uint32_t)sizeof(record), line, record.len);
+            uint32_t check = persist_hash(2166136261u, &record.seq, 2 * sizeof(uint32_t));
+            if (persist_hash(check, line, record.len) == record.check)
+            {
+                wl_log_iovec_t iov = {line, record.len};
+                sink_writev(&iov, 1);
+                *first_seq = found == 0 ? record.seq : *first_seq;
+                *last_seq = record.seq;
+                found++;
+                at += (uint32_t)(sizeof(record) + record.len + 3u) & ~3u;
+                continue;
+            }
+        }
+        at += 4;
+    }
+    return found;
+}
+
+/* Map or locate the ring, replay the previous run and start a fresh one */
+static void persist_open(void)
+{
+    persist_region_t *region;
+#ifdef PERSIST_MMAP
+    int fd = open(WL_LOG_PERSIST_PATH, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        return;
+    }
+    void *map = MAP_FAILED;
+    if (ftruncate(fd, sizeof(persist_region_t)) == 0)
+    {
+        map = mmap(NULL, sizeof(persist_region_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        return;
+    }
+    region = (persist_region_t *)map;
+#else
+    region = &persist_storage;
+#endif
+
+    uint32_t first_seq = 0;
+    uint32_t last_seq = 0;
+    LOG_MUTEX_LOCK();
+    uint32_t found = persist_recover(region, &first_seq, &last_seq);
+    sink_flush();
+
+    memset(region, 0, sizeof(*region));
+    region->version = PERSIST_VERSION;
+    region->size = WL_LOG_PERSIST_SIZE;
+    region->magic = PERSIST_MAGIC;
+    persist = region;
+    LOG_MUTEX_UNLOCK();
+
+    if (found != 0)
+    {
+        log_notice(WL_LOG_WARN, "wl_log", "%lu records recovered from the previous run (seq %lu to %lu)",
+                   (unsigned long)found, (unsigned long)first_seq, (unsigned long)last_seq);
+    }
+}
+#endif
+
+#ifdef WL_LOG_BUFFER_LOCKFREE
+#ifdef RING_SLOT_PRIVATE
+/* Thread exit, the ring goes back to the pool with whatever it still holds */
+static void ring_disown(void *slot)
+{
+    __atomic_store_n(&log_rings[(intptr_t)slot].owned, 0, __ATOMIC_RELEASE);
+}
+
+static void ring_key_create(void)
+{
+    pthread_key_create(&thread_ring_key, ring_disown);
+}
+
+/* Claim a free ring for the calling thread, -1 when all are taken */
+static int ring_claim(void)
+{
+    pthread_once(&thread_ring_once, ring_key_create);
+    for (int i = 1; i < RING_COUNT; i++)
+    {
+        if (!__atomic_exchange_n(&log_rings[i].owned, 1, __ATOMIC_ACQUIRE))
+        {
+            pthread_setspecific(thread_ring_key, (void *)(intptr_t)i);
+            return i;
+        }
+    }
+    return -1;
+}
+#endif
+
+/* Ring the calling thread writes to, 0 is the shared one */
+static inline int ring_select(void)
+{
+#if defined(RING_SLOT_PRIVATE)
+    if (thread_ring == 0)
+    {
+        thread_ring = ring_claim();
+    }
+    return thread_ring > 0 ? thread_ring : 0;
+#elif defined(WL_LOG_BUFFER_PER_THREAD)
+    return 1 + (int)xPortGetCoreID();
+#else
+    return 0;
+#endif
+}
+
+/* Reserve, fill and publish one record, drops the message when the ring is full. Returns the bytes dropped */
+static size_t ring_push(wl_log_level_t level, const wl_log_iovec_t *iov, size_t count, uint8_t kind, uint64_t stamp)
+{
+    int index = ring_select();
+    log_buffer_t *ring = &log_rings[index];
+
+    size_t len = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        len += iov[i].len;
+    }
+    size_t dropped = 0;
+    if (len > RING_MAX_PAYLOAD)
+    {
+        dropped = len - RING_MAX_PAYLOAD;
+        len = RING_MAX_PAYLOAD;
+    }
+
+    uint32_t need = RING_RECORD_SIZE(len);
+    uint32_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    uint32_t pad;
+    uint32_t tail;
+    do
+    {
+        /* A record never wraps, the rest of the lap becomes a padding record */
+        uint32_t room = WL_LOG_BUFFER_SIZE - (pos & RING_MASK);
+        pad = need > room ? room : 0;
+        tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (pos + pad + need - tail > WL_LOG_BUFFER_SIZE)
+        {
+            return dropped + len;
+        }
+#ifdef RING_SLOT_PRIVATE
+        if (index > 0)
+        {
+            /* Only this thread produces here, no CAS needed */
+            __atomic_store_n(&ring->head, pos + pad + need, __ATOMIC_RELAXED);
+            break;
+        }
+#endif
+    } while (!__atomic_compare_exchange_n(&ring->head, &pos, pos + pad + need, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    STATS_HIGH_WATER(pos + pad + need - tail);
+
+    if (pad)
+    {
+        ring_record_t *skip = (ring_record_t *)&ring->data[pos & RING_MASK];
+        skip->len = 0;
+        skip->kind = RING_KIND_PAD;
+        __atomic_store_n(&skip->commit, pos + 1, __ATOMIC_RELEASE);
+        pos += pad;
+    }
+
+    ring_record_t *record = (ring_record_t *)&ring->data[pos & RING_MASK];
+#ifdef WL_LOG_BUFFER_PER_THREAD
+    record->stamp = stamp;
+#else
+    (void)stamp;
+#endif
+    record->len = (uint16_t)len;
+    record->kind = kind;
+    record->level = (uint8_t)level;
+    uint8_t *out = (uint8_t *)(record + 1);
+    for (size_t i = 0; i < count && len > 0; i++)
+    {
+        size_t n = iov[i].len < len ? iov[i].len : len;
+        memcpy(out, iov[i].data, n);
+        out += n;
+        len -= n;
+    }
+    __atomic_store_n(&record->commit, pos + 1, __ATOMIC_RELEASE);
+    return dropped;
+}
+
+#ifdef WL_LOG_ASYNC
+/* Bytes reserved and not yet drained, over every ring */
+static uint32_t ring_pending(void)
+{
+    uint32_t pending = 0;
+    for (int i = 0; i < RING_COUNT; i++)
+    {
+        pending += __atomic_load_n(&log_rings[i].head, __ATOMIC_ACQUIRE) - __atomic_load_n(&log_rings[i].tail, __ATOMIC_ACQUIRE);
+    }
+    return pending;
+}
+#endif
+
+/* Text records handed to the sinks in one vectored write */
+#define RING_DRAIN_BATCH 16
+
+/* Zero drained records of a ring from its tail up to end and give the space back to producers */
+static void ring_release(log_buffer_t *ring, uint32_t end)
+{
+    uint32_t tail = ring->tail;
+    uint32_t len = end - tail;
+    uint32_t first = WL_LOG_BUFFER_SIZE - (tail & RING_MASK);
+    if (first > len)
+    {
+        first = len;
+    }
+    memset(&ring->data[tail & RING_MASK], 0, first);
+    memset(ring->data, 0, len - first);
+    __atomic_store_n(&ring->tail, end, __ATOMIC_RELEASE);
+}
+
+/* First published record at *pos, padding skipped, NULL when there is none yet */
+static ring_record_t *ring_peek(log_buffer_t *ring, uint32_t *pos)
+{
+    for (;;)
+    {
+        ring_record_t *record = (ring_record_t *)&ring->data[*pos & RING_MASK];
+        if (__atomic_load_n(&record->commit, __ATOMIC_ACQUIRE) != *pos + 1)
+        {
+            return NULL;
+        }
+        if (record->kind != RING_KIND_PAD)
+        {
+            return record;
+        }
+        *pos += WL_LOG_BUFFER_SIZE - (*pos & RING_MASK);
+    }
+}
+
+/* Send one record, plain text is gathered in batch for the caller to write */
+static void ring_emit(const ring_record_t *record, wl_log_iovec_t *batch, size_t *count)
+{
+#ifdef WL_LOG_DEFERRED
+    if (stream_enabled || record->kind == RING_KIND_DEFERRED)
+    {
+        /* Keep the order, text gathered so far goes first */
+        if (*count > 0)
+        {
+            sink_writev(batch, *count);
+            *count = 0;
+        }
+        if (stream_enabled)
+        {
+            stream_write(record->kind, (const uint8_t *)(record + 1), record->len);
+        }
+        else
+        {
+            char line[LOG_LINE_SIZE];
+            wl_log_iovec_t iov[2] = {{line, deferred_render(line, (const uint8_t *)(record + 1), record->len)},
+                                     {log_trailer, LOG_TRAILER_LEN}};
+            sink_writev(iov, 2);
+        }
+        return;
+    }
+#endif
+    batch[*count].data = (const char *)(record + 1);
+    batch[*count].len = record->len;
+    (*count)++;
+}
+
+/* Single consumer, hand published records to the sinks in order until budget bytes are drained */
+static size_t ring_drain(size_t budget)
+{
+    wl_log_iovec_t batch[RING_DRAIN_BATCH];
+    size_t count = 0;
+    size_t drained = 0;
+    int error = 0;
+    uint32_t tails[RING_COUNT];
+    for (int i = 0; i < RING_COUNT; i++)
+    {
+        tails[i] = log_rings[i].tail;
+    }
+
+    while (drained < budget)
+    {
+        /* Oldest head record over all rings */
+        int source = -1;
+        ring_record_t *record = NULL;
+        for (int i = 0; i < RING_COUNT; i++)
+        {
+            ring_record_t *candidate = ring_peek(&log_rings[i], &tails[i]);
+#ifdef WL_LOG_BUFFER_PER_THREAD
+            if (candidate != NULL && (record == NULL || candidate->stamp < record->stamp))
+#else
+            if (candidate != NULL)
+#endif
+            {
+                record = candidate;
+                source = i;
+            }
+        }
+        if (record == NULL)
+        {
+            break;
+        }
+
+        ring_emit(record, batch, &count);
+        error |= record->level == WL_LOG_ERROR;
+        uint32_t size = RING_RECORD_SIZE(record->len);
+        tails[source] += size;
+        drained += size;
+
+        if (count == RING_DRAIN_BATCH)
+        {
+            sink_writev(batch, count);
+            count = 0;
+            for (int i = 0; i < RING_COUNT; i++)
+            {
+                if (tails[i] != log_rings[i].tail)
+                {
+                    ring_release(&log_rings[i], tails[i]);
+                }
+            }
+        }
+    }
+
+    if (count > 0)
+    {
+        sink_writev(batch, count);
+    }
+    if (error)
+    {
+        sink_error_written();
+    }
+    for (int i = 0; i < RING_COUNT; i++)
+    {
+        if (tails[i] != log_rings[i].tail)
+        {
+            ring_release(&log_rings[i], tails[i]);
+        }
+    }
+    return drained;
+}
+#endif
+
+#ifdef WL_LOG_DEFERRED
+/*
+ * Deferred records keep the format pointer and the raw arguments, vsnprintf
+ * only runs when the ring is drained. The format string must outlive the
+ * record (string literals do), %s arguments are copied. The argument layout
+ * is described in wl_log_format.h.
+ */
+typedef struct
+{
+    uint64_t time;
+    const char *format;
+    int16_t tag;
+    uint8_t level;
+    uint8_t reserved;
+} deferred_header_t;
+
+/* Pack the arguments behind a deferred_header_t and push the record */
+static int deferred_push(wl_log_level_t level, wl_log_tag_t handle, const char *format, va_list args)
+{
+#ifdef WL_LOG_FLIGHT_RECORDER
+    /* The recorder keeps text, recorded levels take the formatting path */
+    if (flight_captures(level))
+    {
+        return 0;
+    }
+    if (level == WL_LOG_ERROR)
+    {
+        wl_log_flight_trigger();
+    }
+#endif
+
+    if (handle < 0)
+    {
+        /* The record only has room for a handle. Unregistered tags take the text path,
+         * registering them here would fill the shared tag table and take the log mutex */
+        return 0;
+    }
+
+    uint8_t record[256];
+    deferred_header_t header = {log_stamp(), format, handle, (uint8_t)level, 0};
+    memcpy(record, &header, sizeof(header));
+    size_t used = sizeof(header);
+
+    fmt_spec_t spec;
+    const char *p = format;
+    int cut = 0;
+    while ((p = fmt_next(p, &spec)) != NULL)
+    {
+        int32_t star = 0;
+        for (int i = 0; i < spec.stars; i++)
+        {
+            star = (int32_t)va_arg(args, int);
+            if (used + sizeof(star) > sizeof(record))
+            {
+                goto full;
+            }
+            memcpy(record + used, &star, sizeof(star));
+            used += sizeof(star);
+        }
+
+        uint64_t wide_value;
+        uint32_t narrow_value;
+        double real_value;
+        const void *value = NULL;
+        size_t value_len = 0;
+
+        switch (spec.conv)
+        {
+        case 'd':
+        case 'i':
+            switch (spec.wide)
+            {
+            case 'l': wide_value = (uint64_t)(int64_t)va_arg(args, long); break;
+            case 'q': wide_value = (uint64_t)(int64_t)va_arg(args, long long); break;
+            case 'z': wide_value = (uint64_t)(int64_t)va_arg(args, size_t); break;
+            case 'j': wide_value = (uint64_t)(int64_t)va_arg(args, intmax_t); break;
+            case 't': wide_value = (uint64_t)(int64_t)va_arg(args, ptrdiff_t); break;
+            default:
+                narrow_value = (uint32_t)va_arg(args, int);
+                value = &narrow_value;
+                value_len = sizeof(narrow_value);
+                break;
+            }
+            break;
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+            switch (spec.wide)
+            {
+            case 'l': wide_value = (uint64_t)va_arg(args, unsigned long); break;
+            case 'q': wide_value = (uint64_t)va_arg(args, unsigned long long); break;
+            case 'z': wide_value = (uint64_t)va_arg(args, size_t); break;
+            case 'j': wide_value = (uint64_t)va_arg(args, uintmax_t); break;
+            case 't': wide_value = (uint64_t)va_arg(args, ptrdiff_t); break;
+            default:
+                narrow_value = (uint32_t)va_arg(args, unsigned int);
+                value = &narrow_value;
+                value_len = sizeof(narrow_value);
+                break;
+            }
+            break;
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            real_value = spec.wide == 'L' ? (double)va_arg(args, long double) : va_arg(args, double);
+            value = &real_value;
+            value_len = sizeof(real_value);
+            break;
+        case 'c':
+            narrow_value = (uint32_t)va_arg(args, int);
+            value = &narrow_value;
+            value_len = sizeof(narrow_value);
+            break;
+        case 'p':
+            wide_value = (uint64_t)(uintptr_t)va_arg(args, void *);
+            break;
+        case 's':
+        {
+            const char *str = va_arg(args, const char *);
+            if (str == NULL)
+            {
+                str = "(null)";
+            }
+            size_t str_len = 0;
+            /* "%.*s" takes its precision from the last star, negative means none */
+            int precision = spec.star_precision ? (int)star : spec.precision;
+            size_t limit = precision >= 0 ? (size_t)precision : 0xFFFF;
+            while (str_len < limit && str[str_len] != '\0')
+            {
+                str_len++;
+            }
+            if (used + sizeof(uint16_t) > sizeof(record))
+            {
+                goto full;
+            }
+            /* A long string is cut to what is left of the record */
+            if (str_len > sizeof(record) - used - sizeof(uint16_t))
+            {
+                str_len = sizeof(record) - used - sizeof(uint16_t);
+                cut = 1;
+            }
+            uint16_t len16 = (uint16_t)str_len;
+            memcpy(record + used, &len16, sizeof(len16));
+            memcpy(record + used + sizeof(len16), str, str_len);
+            used += sizeof(len16) + str_len;
+            continue;
+        }
+        case 'n':
+            (void)va_arg(args, void *);
+            continue;
+        default:
+            /* %% or something we do not know, nothing to pack */
+            continue;
+        }
+
+        if (value == NULL)
+        {
+            value = &wide_value;
+            value_len = sizeof(wide_value);
+        }
+        if (used + value_len > sizeof(record))
+        {
+            goto full;
+        }
+        memcpy(record + used, value, value_len);
+        used += value_len;
+    }
+
+full:
+    /* Arguments left over when the record filled up */
+    if (cut || p != NULL)
+    {
+        STATS_ADD(truncated, level, 1);
+    }
+#ifdef WL_LOG_COALESCE
+    /* Format and arguments identify the message, the time in the header does not */
+    uint64_t hash = repeat_hash(14695981039346656037ull, &header.format, sizeof(header.format));
+    hash = repeat_hash(hash, &handle, sizeof(handle));
+    hash = repeat_hash(hash, &level, sizeof(level));
+    if (repeat_suppress(level, tag_table[handle].name, repeat_hash(hash, record + sizeof(header), used - sizeof(header)), header.time))
+    {
+        return 1;
+    }
+#endif
+    wl_log_iovec_t iov = {(const char *)record, used};
+    stats_output(level, ring_push(level, &iov, 1, RING_KIND_DEFERRED, header.time));
+#ifdef WL_LOG_ASYNC
+    async_notify(level);
+#endif
+    return 1;
+}
+
+/* Turn a deferred record back into the line wl_log_print would have built, without the trailer */
+static size_t deferred_render(char *out, const uint8_t *record, size_t len)
+{
+    deferred_header_t header;
+    if (len < sizeof(header))
+    {
+        return 0;
+    }
+    memcpy(&header, record, sizeof(header));
+
+    size_t used = format_header(out, (wl_log_level_t)header.level, log_stamp_us(header.time),
+                                header.tag >= 0 && header.tag < __atomic_load_n(&tag_count, __ATOMIC_ACQUIRE) ? tag_table[header.tag].name : "?");
+    used += fmt_render(out + used, LOG_BODY_SIZE, header.format, record + sizeof(header), len - sizeof(header));
+    return used;
+}
+
+/* Drain deferred records as a binary stream for wl_log_decode */
+void wl_log_set_binary_output(int enable)
+{
+    LOG_MUTEX_LOCK();
+
+    stream_enabled = enable ? 1 : 0;
+    stream_started = 0;
+
+    LOG_MUTEX_UNLOCK();
+}
+
+static uint8_t *put_u16(uint8_t *p, uint16_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    return p + 2;
+}
+
+static uint8_t *put_u32(uint8_t *p, uint32_t v)
+{
+    p = put_u16(p, (uint16_t)v);
+    return put_u16(p, (uint16_t)(v >> 16));
+}
+
+static uint8_t *put_u64(uint8_t *p, uint64_t v)
+{
+    p = put_u32(p, (uint32_t)v);
+    return put_u32(p, (uint32_t)(v >> 32));
+}
+
+/* One stream record, the frame up to end and its payload in a single vectored write */
+static void stream_emit(const uint8_t *frame, const uint8_t *end, const char *payload, size_t len)
+{
+    wl_log_iovec_t iov[2] = {{(const char *)frame, (size_t)(end - frame)}, {payload, len}};
+    sink_writev(iov, 2);
+}
+
+/* Emit one ring record, preceded by the definitions the decoder is missing */
+static void stream_write(uint8_t kind, const uint8_t *record, size_t len)
+{
+    uint8_t frame[32];
+    uint8_t *p = frame;
+
+    if (!stream_started)
+    {
+        /* New stream, the decoder knows nothing yet */
+        memcpy(p, WL_LOG_STREAM_MAGIC, 4);
+        p[4] = WL_LOG_STREAM_VERSION;
+        p[5] = WL_LOG_USE_COLORS ? WL_LOG_STREAM_COLORS : 0;
+#ifdef WL_LOG_TIMESTAMP_US
+        p[5] |= WL_LOG_STREAM_MICROS;
+#endif
+        wl_log_iovec_t start = {(const char *)frame, WL_LOG_STREAM_HEADER_SIZE};
+        sink_writev(&start, 1);
+        memset(stream_formats, 0, sizeof(stream_formats));
+        memset(stream_tags, 0, sizeof(stream_tags));
+        stream_started = 1;
+    }
+
+    if (kind != RING_KIND_DEFERRED)
+    {
+        *p++ = WL_LOG_STREAM_TEXT;
+        p = put_u16(p, (uint16_t)len);
+        stream_emit(frame, p, (const char *)record, len);
+        return;
+    }
+
+    deferred_header_t header;
+    if (len < sizeof(header))
+    {
+        return;
+    }
+    memcpy(&header, record, sizeof(header));
+
+    if (header.tag >= 0 && header.tag < __atomic_load_n(&tag_count, __ATOMIC_ACQUIRE) && !(stream_tags[header.tag / 8] & (1u << (header.tag % 8))))
+    {
+        const char *name = tag_table[header.tag].name;
+        size_t name_len = strlen(name);
+        *p++ = WL_LOG_STREAM_TAG;
+        p = put_u16(p, (uint16_t)header.tag);
+        *p++ = (uint8_t)name_len;
+        stream_emit(frame, p, name, name_len);
+        stream_tags[header.tag / 8] |= (uint8_t)(1u << (header.tag % 8));
+        p = frame;
+    }
+
+    uint64_t format_id = (uint64_t)(uintptr_t)header.format;
+    size_t slot = (size_t)((format_id >> 3) % WL_LOG_STREAM_FORMAT_CACHE);
+    if (stream_formats[slot] != header.format)
+    {
+        size_t format_len = strlen(header.format);
+        if (format_len > 0xFFFF)
+        {
+            format_len = 0xFFFF;
+        }
+        *p++ = WL_LOG_STREAM_FORMAT;
+        p = put_u64(p, format_id);
+        p = put_u16(p, (uint16_t)format_len);
+        stream_emit(frame, p, header.format, format_len);
+        stream_formats[slot] = header.format;
+        p = frame;
+    }
+
+    *p++ = WL_LOG_STREAM_EVENT;
+    p = put_u64(p, format_id);
+    p = put_u64(p, log_stamp_us(header.time));
+    p = put_u16(p, (uint16_t)header.tag);
+    *p++ = header.level;
+    p = put_u16(p, (uint16_t)(len - sizeof(header)));
+    stream_emit(frame, p, (const char *)record + sizeof(header), len - sizeof(header));
 }
+#endif /* WL_LOG_DEFERRED */
 
 #ifdef WL_LOG_USE_UART
 void wl_log_uart_init(void)
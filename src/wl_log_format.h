@@ -0,0 +1,426 @@
+/**
+ * @file wl_log_format.h
+ * @brief Deferred argument layout shared by wl_log.c and the host decoder.
+ *
+ * A deferred message keeps its format string and the raw arguments packed in
+ * format order, little endian:
+ *
+ * - '*' width or precision: 4 bytes
+ * - int sized integers (no modifier, hh, h) and %c: 4 bytes
+ * - l, ll, z, j and t integers: 8 bytes, sign extended for %d / %i
+ * - floating point: 8 byte double (long double is narrowed)
+ * - %p: 8 bytes
+ * - %s: 16 bit length plus the bytes, no terminator
+ *
+ * fmt_render turns the format and the packed bytes back into the text
+ * vsnprintf would have produced.
+ *
+ * The binary stream written by wl_log_set_binary_output starts with
+ * "WLOG", a version byte and a flags byte, then carries records made of a
+ * type byte and little endian fields:
+ *
+ * - 'F' format:  u64 id, u16 len, text
+ * - 'T' tag:     i16 handle, u8 len, text
+ * - 'E' event:   u64 format id, u64 time in us, i16 tag, u8 level, u16 len, packed args
+ * - 'X' text:    u16 len, already formatted text
+ * - 'W' a new stream header ("WLOG..."), the dictionaries start over
+ *
+ * A format or tag is always defined before the first event using it and
+ * may be defined again later, the last definition wins.
+ *
+ * @license MIT License
+ */
+
+#ifndef _WL_LOG_FORMAT
+#define _WL_LOG_FORMAT
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define WL_LOG_STREAM_MAGIC "WLOG"
+#define WL_LOG_STREAM_VERSION 2
+#define WL_LOG_STREAM_HEADER_SIZE 6
+#define WL_LOG_STREAM_COLORS 0x01    /* lines carry ANSI colors */
+#define WL_LOG_STREAM_MICROS 0x02    /* timestamps print as millis.micros */
+
+#define WL_LOG_STREAM_EVENT_SIZE 22     /* event record up to the packed args */
+
+#define WL_LOG_STREAM_FORMAT 'F'
+#define WL_LOG_STREAM_TAG 'T'
+#define WL_LOG_STREAM_EVENT 'E'
+#define WL_LOG_STREAM_TEXT 'X'
+#define WL_LOG_STREAM_RESTART 'W'
+
+typedef struct
+{
+    const char *start; /* the '%' */
+    size_t len;        /* up to and including the conversion */
+    char conv;
+    uint8_t wide;      /* l, ll, z, j, t or L modifier */
+    uint8_t stars;     /* '*' width and precision */
+    uint8_t star_precision; /* the last '*' is the precision */
+    int precision;     /* -1 when absent or '*' */
+} fmt_spec_t;
+
+/* Find the next conversion, returns NULL at the end of the format */
+static const char *fmt_next(const char *p, fmt_spec_t *spec)
+{
+    p = strchr(p, '%');
+    if (p == NULL)
+    {
+        return NULL;
+    }
+
+    spec->start = p++;
+    spec->wide = 0;
+    spec->stars = 0;
+    spec->star_precision = 0;
+    spec->precision = -1;
+
+    while (*p == '-' || *p == '+' || *p == ' ' || *p == '#' || *p == '0')
+    {
+        p++;
+    }
+    if (*p == '*')
+    {
+        spec->stars++;
+        p++;
+    }
+    while (*p >= '0' && *p <= '9')
+    {
+        p++;
+    }
+    if (*p == '.')
+    {
+        p++;
+        if (*p == '*')
+        {
+            spec->stars++;
+            spec->star_precision = 1;
+            p++;
+        }
+        else
+        {
+            spec->precision = 0;
+            while (*p >= '0' && *p <= '9')
+            {
+                spec->precision = spec->precision * 10 + (*p++ - '0');
+            }
+        }
+    }
+    while (*p == 'h' || *p == 'l' || *p == 'z' || *p == 'j' || *p == 't' || *p == 'L')
+    {
+        if (*p != 'h')
+        {
+            spec->wide = (uint8_t)*p;
+            if (p[0] == 'l' && p[1] == 'l')
+            {
+                spec->wide = 'q';
+                p++;
+            }
+        }
+        p++;
+    }
+
+    spec->conv = *p;
+    if (*p != '\0')
+    {
+        p++;
+    }
+    spec->len = (size_t)(p - spec->start);
+    return p;
+}
+
+/* No flags, width, precision or h modifier, the common case skips snprintf */
+static int fmt_is_plain(const fmt_spec_t *spec)
+{
+    for (size_t i = 1; i + 1 < spec->len; i++)
+    {
+        char ch = spec->start[i];
+        if (ch != 'l' && ch != 'z' && ch != 'j' && ch != 't')
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Append len bytes to body, cut at size - 1, returns the new length */
+static size_t fmt_append(char *body, size_t size, size_t used, const char *text, size_t len)
+{
+    if (len > size - 1 - used)
+    {
+        len = size - 1 - used;
+    }
+    memcpy(body + used, text, len);
+    used += len;
+    body[used] = '\0';
+    return used;
+}
+
+/* Plain %d %i %u %x %X, returns the number of characters in out */
+static size_t fmt_integer(char *out, uint64_t value, char conv, int wide)
+{
+    static const char lower[] = "0123456789abcdef";
+    static const char upper[] = "0123456789ABCDEF";
+    const char *digits = conv == 'X' ? upper : lower;
+    unsigned base = conv == 'x' || conv == 'X' ? 16u : 10u;
+    int negative = 0;
+
+    if (conv == 'd' || conv == 'i')
+    {
+        int64_t signed_value = wide ? (int64_t)value : (int64_t)(int32_t)(uint32_t)value;
+        negative = signed_value < 0;
+        value = negative ? 0u - (uint64_t)signed_value : (uint64_t)signed_value;
+    }
+    else if (!wide)
+    {
+        value = (uint32_t)value;
+    }
+
+    /* Constant divisors, the compiler turns them into multiplications */
+    char tmp[24];
+    size_t n = 0;
+    if (base == 16u)
+    {
+        do
+        {
+            tmp[n++] = digits[value & 0xFu];
+            value >>= 4;
+        } while (value != 0);
+    }
+    else if (value <= 0xFFFFFFFFu)
+    {
+        uint32_t value32 = (uint32_t)value;
+        do
+        {
+            tmp[n++] = (char)('0' + value32 % 10u);
+            value32 /= 10u;
+        } while (value32 != 0);
+    }
+    else
+    {
+        do
+        {
+            tmp[n++] = (char)('0' + value % 10u);
+            value /= 10u;
+        } while (value != 0);
+    }
+
+    size_t len = 0;
+    if (negative)
+    {
+        out[len++] = '-';
+    }
+    while (n > 0)
+    {
+        out[len++] = tmp[--n];
+    }
+    return len;
+}
+
+/* The spec with l, ll, z, j, t and L turned into ll (integers) or nothing */
+static void fmt_conv(char *conv, size_t size, const fmt_spec_t *spec)
+{
+    size_t c = 0;
+    for (size_t i = 0; i + 1 < spec->len && c < size - 4; i++)
+    {
+        char ch = spec->start[i];
+        if (ch != 'l' && ch != 'z' && ch != 'j' && ch != 't' && ch != 'L')
+        {
+            conv[c++] = ch;
+        }
+    }
+    if (spec->wide != 0 && spec->wide != 'L' && spec->conv != 'p' && spec->conv != 's')
+    {
+        conv[c++] = 'l';
+        conv[c++] = 'l';
+    }
+    conv[c++] = spec->conv;
+    conv[c] = '\0';
+}
+
+/* Print one packed argument with its own conversion spec */
+#define FMT_SNPRINTF(value)                                                                \
+    (fmt_conv(conv, sizeof(conv), &spec),                                                  \
+     spec.stars == 0   ? snprintf(body + used, size - used, conv, value)                   \
+     : spec.stars == 1 ? snprintf(body + used, size - used, conv, stars[0], value)         \
+                       : snprintf(body + used, size - used, conv, stars[0], stars[1], value))
+
+/* Format the packed args into body (always terminated), returns the text length */
+static size_t fmt_render(char *body, size_t size, const char *format, const uint8_t *args, size_t len)
+{
+    const uint8_t *arg = args;
+    const uint8_t *end = args + len;
+    size_t used = 0;
+    body[0] = '\0';
+
+    fmt_spec_t spec;
+    const char *literal = format;
+    const char *p = format;
+    while (used < size - 1)
+    {
+        const char *next = fmt_next(p, &spec);
+        const char *literal_end = next != NULL ? spec.start : p + strlen(p);
+
+        size_t n = (size_t)(literal_end - literal);
+        if (n > size - 1 - used)
+        {
+            n = size - 1 - used;
+        }
+        memcpy(body + used, literal, n);
+        used += n;
+        body[used] = '\0';
+        if (next == NULL)
+        {
+            break;
+        }
+        p = literal = next;
+
+        char conv[32];
+
+        int stars[2] = {0, 0};
+        for (int i = 0; i < spec.stars; i++)
+        {
+            int32_t star;
+            if (end - arg < (ptrdiff_t)sizeof(star))
+            {
+                goto done;
+            }
+            memcpy(&star, arg, sizeof(star));
+            arg += sizeof(star);
+            stars[i] = star;
+        }
+
+        int plain = fmt_is_plain(&spec);
+        int written = 0;
+        switch (spec.conv)
+        {
+        case 'd':
+        case 'i':
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+        case 'c':
+            if (spec.wide != 0 && spec.conv != 'c')
+            {
+                uint64_t value;
+                if (end - arg < (ptrdiff_t)sizeof(value))
+                {
+                    goto done;
+                }
+                memcpy(&value, arg, sizeof(value));
+                arg += sizeof(value);
+                if (plain && spec.conv != 'o')
+                {
+                    char digits[24];
+                    used = fmt_append(body, size, used, digits, fmt_integer(digits, value, spec.conv, 1));
+                    break;
+                }
+                written = FMT_SNPRINTF((long long)value);
+            }
+            else
+            {
+                uint32_t value;
+                if (end - arg < (ptrdiff_t)sizeof(value))
+                {
+                    goto done;
+                }
+                memcpy(&value, arg, sizeof(value));
+                arg += sizeof(value);
+                if (plain && spec.conv == 'c')
+                {
+                    char ch = (char)value;
+                    used = fmt_append(body, size, used, &ch, 1);
+                    break;
+                }
+                if (plain && spec.conv != 'o')
+                {
+                    char digits[24];
+                    used = fmt_append(body, size, used, digits, fmt_integer(digits, value, spec.conv, 0));
+                    break;
+                }
+                written = FMT_SNPRINTF((int)value);
+            }
+            break;
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+        {
+            double value;
+            if (end - arg < (ptrdiff_t)sizeof(value))
+            {
+                goto done;
+            }
+            memcpy(&value, arg, sizeof(value));
+            arg += sizeof(value);
+            written = FMT_SNPRINTF(value);
+            break;
+        }
+        case 'p':
+        {
+            uint64_t value;
+            if (end - arg < (ptrdiff_t)sizeof(value))
+            {
+                goto done;
+            }
+            memcpy(&value, arg, sizeof(value));
+            arg += sizeof(value);
+            written = FMT_SNPRINTF((void *)(uintptr_t)value);
+            break;
+        }
+        case 's':
+        {
+            uint16_t str_len;
+            char str[256];
+            if (end - arg < (ptrdiff_t)sizeof(str_len))
+            {
+                goto done;
+            }
+            memcpy(&str_len, arg, sizeof(str_len));
+            arg += sizeof(str_len);
+            if (str_len > end - arg || str_len >= sizeof(str))
+            {
+                goto done;
+            }
+            if (plain)
+            {
+                used = fmt_append(body, size, used, (const char *)arg, str_len);
+                arg += str_len;
+                break;
+            }
+            memcpy(str, arg, str_len);
+            str[str_len] = '\0';
+            arg += str_len;
+            written = FMT_SNPRINTF(str);
+            break;
+        }
+        case '%':
+            body[used++] = '%';
+            body[used] = '\0';
+            break;
+        default:
+            break;
+        }
+
+        if (written > 0)
+        {
+            used += (size_t)written < size - used ? (size_t)written : size - 1 - used;
+        }
+    }
+
+done:
+    return used;
+}
+
+#undef FMT_SNPRINTF
+
+#endif
@@ -0,0 +1,360 @@
+/**
+ * @file wl_log_decode.c
+ * @brief Turn a binary wl_log stream back into the text wl_log_print would have printed.
+ *
+ * Usage: wl_log_decode [file]   (stdin when no file or "-")
+ *
+ * The stream format is described in src/wl_log_format.h. Input is read in
+ * fixed chunks and output goes through one large buffer, so memory stays
+ * constant whatever the size of the capture. Only the format and tag
+ * dictionaries grow, with the number of distinct call sites.
+ *
+ * @license MIT License
+ */
+
+#include "wl_log_format.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INPUT_CHUNK (1u << 20)
+#define OUTPUT_CHUNK (1u << 20)
+#define MAX_RECORD (WL_LOG_STREAM_EVENT_SIZE + 0xFFFF)
+#define MAX_TAGS 32768
+#define MAX_LINE 512 /* header, 255 characters of body, colors and newline */
+#define MAX_BODY 256
+
+typedef struct
+{
+    uint64_t id;
+    char *text;
+} format_entry_t;
+
+static format_entry_t *formats;
+static size_t format_capacity;
+static size_t format_count;
+
+static char *tags[MAX_TAGS];
+
+static int colors;
+static int micros;
+
+static char out[OUTPUT_CHUNK];
+static size_t out_used;
+
+static uint16_t get_u16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get_u32(const uint8_t *p)
+{
+    return (uint32_t)get_u16(p) | ((uint32_t)get_u16(p + 2) << 16);
+}
+
+static uint64_t get_u64(const uint8_t *p)
+{
+    return (uint64_t)get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+static void out_flush(void)
+{
+    fwrite(out, 1, out_used, stdout);
+    out_used = 0;
+}
+
+static void out_put(const char *data, size_t len)
+{
+    if (out_used + len > sizeof(out))
+    {
+        out_flush();
+    }
+    if (len > sizeof(out))
+    {
+        fwrite(data, 1, len, stdout);
+        return;
+    }
+    memcpy(out + out_used, data, len);
+    out_used += len;
+}
+
+static void reset_dictionaries(void)
+{
+    for (size_t i = 0; i < format_capacity; i++)
+    {
+        free(formats[i].text);
+        formats[i].text = NULL;
+    }
+    format_count = 0;
+    for (size_t i = 0; i < MAX_TAGS; i++)
+    {
+        free(tags[i]);
+        tags[i] = NULL;
+    }
+}
+
+/* Open addressing, the table only grows with the number of call sites */
+static format_entry_t *format_slot(uint64_t id)
+{
+    size_t mask = format_capacity - 1;
+    size_t i = (size_t)((id >> 3) * 0x9E3779B97F4A7C15ull) & mask;
+    while (formats[i].text != NULL && formats[i].id != id)
+    {
+        i = (i + 1) & mask;
+    }
+    return &formats[i];
+}
+
+static void format_define(uint64_t id, const uint8_t *text, size_t len)
+{
+    if ((format_count + 1) * 2 > format_capacity)
+    {
+        format_entry_t *old = formats;
+        size_t old_capacity = format_capacity;
+        format_capacity = format_capacity ? format_capacity * 2 : 256;
+        formats = calloc(format_capacity, sizeof(*formats));
+        if (formats == NULL)
+        {
+            fprintf(stderr, "wl_log_decode: out of memory\n");
+            exit(1);
+        }
+        for (size_t i = 0; i < old_capacity; i++)
+        {
+            if (old[i].text != NULL)
+            {
+                *format_slot(old[i].id) = old[i];
+            }
+        }
+        free(old);
+    }
+
+    format_entry_t *slot = format_slot(id);
+    if (slot->text == NULL)
+    {
+        format_count++;
+    }
+    free(slot->text);
+    slot->id = id;
+    slot->text = malloc(len + 1);
+    if (slot->text == NULL)
+    {
+        fprintf(stderr, "wl_log_decode: out of memory\n");
+        exit(1);
+    }
+    memcpy(slot->text, text, len);
+    slot->text[len] = '\0';
+}
+
+/* Same header, colors and caps as format_header in wl_log.c, built in the output buffer */
+static void emit_event(uint64_t time, int16_t tag, uint8_t level, const char *format, const uint8_t *args, size_t args_len)
+{
+    static const char *const names[] = {"UNKNOWN", "ERROR", "WARN", "INFO", "DEBUG", "VERBOSE"};
+    static const char *const color_codes[] = {"\x1b[37m", "\x1b[31m", "\x1b[33m", "\x1b[32m", "\x1b[34m", "\x1b[37m"};
+
+    size_t index = level >= 1 && level <= 5 ? level : 0;
+    const char *tag_name = tag >= 0 && tags[tag] != NULL ? tags[tag] : "?";
+    size_t tag_len = strlen(tag_name);
+
+    /* No line or body copy, the event is rendered where it is written from */
+    if (sizeof(out) - out_used < MAX_LINE)
+    {
+        out_flush();
+    }
+    char *line = out + out_used;
+    size_t len = 0;
+    if (colors)
+    {
+        len = fmt_append(line, MAX_LINE, len, color_codes[index], 5);
+    }
+    line[len++] = '(';
+    len += fmt_integer(line + len, time / 1000u, 'u', 'q');
+    if (micros)
+    {
+        char fraction[4] = {'.', (char)('0' + time % 1000u / 100), (char)('0' + time % 100u / 10), (char)('0' + time % 10u)};
+        len = fmt_append(line, MAX_LINE, len, fraction, sizeof(fraction));
+    }
+    len = fmt_append(line, MAX_LINE, len, ")[", 2);
+    len = fmt_append(line, MAX_LINE, len, names[index], strlen(names[index]));
+    len = fmt_append(line, MAX_LINE, len, "][", 2);
+    len = fmt_append(line, MAX_LINE, len, tag_name, tag_len < 48 ? tag_len : 48);
+    len = fmt_append(line, MAX_LINE, len, "]: ", 3);
+    len += fmt_render(line + len, MAX_BODY, format, args, args_len);
+    if (colors)
+    {
+        len = fmt_append(line, MAX_LINE, len, "\x1b[0m", 4);
+    }
+    len = fmt_append(line, MAX_LINE, len, "\n", 1);
+    out_used += len;
+}
+
+/* Decode one record at p, returns its size, 0 if more input is needed, -1 if corrupt */
+static long decode_record(const uint8_t *p, size_t avail)
+{
+    size_t need;
+    switch (p[0])
+    {
+    case WL_LOG_STREAM_EVENT:
+    {
+        if (avail < WL_LOG_STREAM_EVENT_SIZE)
+        {
+            return 0;
+        }
+        size_t args_len = get_u16(p + WL_LOG_STREAM_EVENT_SIZE - 2);
+        need = WL_LOG_STREAM_EVENT_SIZE + args_len;
+        if (avail < need)
+        {
+            return 0;
+        }
+        format_entry_t *format = format_capacity ? format_slot(get_u64(p + 1)) : NULL;
+        if (format == NULL || format->text == NULL)
+        {
+            return -1;
+        }
+        emit_event(get_u64(p + 9), (int16_t)get_u16(p + 17), p[19], format->text, p + WL_LOG_STREAM_EVENT_SIZE, args_len);
+        return (long)need;
+    }
+    case WL_LOG_STREAM_TEXT:
+        if (avail < 3)
+        {
+            return 0;
+        }
+        need = 3 + (size_t)get_u16(p + 1);
+        if (avail < need)
+        {
+            return 0;
+        }
+        out_put((const char *)p + 3, need - 3);
+        return (long)need;
+    case WL_LOG_STREAM_FORMAT:
+        if (avail < 11)
+        {
+            return 0;
+        }
+        need = 11 + (size_t)get_u16(p + 9);
+        if (avail < need)
+        {
+            return 0;
+        }
+        format_define(get_u64(p + 1), p + 11, need - 11);
+        return (long)need;
+    case WL_LOG_STREAM_TAG:
+    {
+        if (avail < 4)
+        {
+            return 0;
+        }
+        need = 4 + (size_t)p[3];
+        if (avail < need)
+        {
+            return 0;
+        }
+        int16_t handle = (int16_t)get_u16(p + 1);
+        if (handle < 0)
+        {
+            return -1;
+        }
+        free(tags[handle]);
+        tags[handle] = malloc(p[3] + 1u);
+        if (tags[handle] == NULL)
+        {
+            return -1;
+        }
+        memcpy(tags[handle], p + 4, p[3]);
+        tags[handle][p[3]] = '\0';
+        return (long)need;
+    }
+    case WL_LOG_STREAM_RESTART:
+        if (avail < WL_LOG_STREAM_HEADER_SIZE)
+        {
+            return 0;
+        }
+        if (memcmp(p, WL_LOG_STREAM_MAGIC, 4) != 0 || p[4] != WL_LOG_STREAM_VERSION)
+        {
+            return -1;
+        }
+        colors = (p[5] & WL_LOG_STREAM_COLORS) != 0;
+        micros = (p[5] & WL_LOG_STREAM_MICROS) != 0;
+        reset_dictionaries();
+        return WL_LOG_STREAM_HEADER_SIZE;
+    default:
+        return -1;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    FILE *in = stdin;
+    if (argc > 2)
+    {
+        fprintf(stderr, "usage: %s [file]\n", argv[0]);
+        return 2;
+    }
+    if (argc == 2 && strcmp(argv[1], "-") != 0)
+    {
+        in = fopen(argv[1], "rb");
+        if (in == NULL)
+        {
+            perror(argv[1]);
+            return 1;
+        }
+    }
+
+    /* Room for a whole chunk plus an unfinished record carried over */
+    static uint8_t buffer[INPUT_CHUNK + MAX_RECORD];
+    size_t used = 0;
+    unsigned long long offset = 0;
+    int started = 0;
+    int status = 0;
+
+    for (;;)
+    {
+        size_t got = fread(buffer + used, 1, INPUT_CHUNK, in);
+        used += got;
+
+        size_t pos = 0;
+        while (pos < used)
+        {
+            if (!started && buffer[pos] != WL_LOG_STREAM_RESTART)
+            {
+                fprintf(stderr, "wl_log_decode: not a wl_log stream\n");
+                status = 1;
+                goto out;
+            }
+            long n = decode_record(buffer + pos, used - pos);
+            if (n == 0)
+            {
+                break;
+            }
+            if (n < 0)
+            {
+                fprintf(stderr, "wl_log_decode: corrupt record at offset %llu\n", offset + pos);
+                status = 1;
+                goto out;
+            }
+            started = 1;
+            pos += (size_t)n;
+        }
+
+        memmove(buffer, buffer + pos, used - pos);
+        used -= pos;
+        offset += pos;
+
+        if (got == 0)
+        {
+            if (used != 0)
+            {
+                fprintf(stderr, "wl_log_decode: truncated record at offset %llu\n", offset);
+                status = 1;
+            }
+            break;
+        }
+    }
+
+out:
+    out_flush();
+    if (in != stdin)
+    {
+        fclose(in);
+    }
+    return status;
+}